@@ -0,0 +1,53 @@
+#include <algorithm>
+#include <new>
+
+#include "arena.h"
+
+namespace Memory {
+
+namespace {
+
+const size_t firstBlockSize = 4096;
+const size_t maxBlockSize = 64 * 1024;
+
+} // namespace
+
+Arena::Arena():
+    _cur{_inline},
+    _end{_inline + inlineSize},
+    _blocks{nullptr},
+    _nextBlockSize{firstBlockSize}
+{}
+
+Arena::~Arena() {
+    reset();
+}
+
+void Arena::reset() {
+    while (_blocks != nullptr) {
+        auto next = _blocks->next;
+        ::operator delete(_blocks);
+        _blocks = next;
+    }
+    _cur = _inline;
+    _end = _inline + inlineSize;
+    _nextBlockSize = firstBlockSize;
+}
+
+void* Arena::allocateBlock(size_t size, size_t align) {
+    // Blocks double in size so a big request needs only a few of them, and anything too
+    // big for the next block gets one of its own.
+    auto header = (sizeof(Block) + alignof(std::max_align_t) - 1) &
+        ~(alignof(std::max_align_t) - 1);
+    auto blockSize = std::max(_nextBlockSize, header + size + align);
+    _nextBlockSize = std::min(_nextBlockSize * 2, maxBlockSize);
+
+    auto block = static_cast<Block*>(::operator new(blockSize));
+    block->next = _blocks;
+    _blocks = block;
+    _cur = reinterpret_cast<unsigned char*>(block) + header;
+    _end = reinterpret_cast<unsigned char*>(block) + blockSize;
+    return allocate(size, align);
+}
+
+} // namespace Memory
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <vector>
+
+namespace Memory {
+
+// Arena hands out memory for things that all go away together, like everything parsed out
+// of one request. Allocating bumps a pointer through the current block, freeing is a no-op,
+// and reset() or the destructor gives it all back at once. The first block lives inside the
+// Arena itself, so an arena embedded in a longer-lived object costs no allocations until it
+// outgrows that block.
+//
+// An Arena isn't thread safe. Whoever owns it must not use it from two threads at once.
+class Arena {
+public:
+    static const size_t inlineSize = 1024;
+
+    Arena();
+    ~Arena();
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    void* allocate(size_t size, size_t align) {
+        auto pos = reinterpret_cast<uintptr_t>(_cur);
+        auto aligned = (pos + align - 1) & ~(static_cast<uintptr_t>(align) - 1);
+        if (aligned + size > reinterpret_cast<uintptr_t>(_end))
+            return allocateBlock(size, align);
+        _cur = reinterpret_cast<unsigned char*>(aligned + size);
+        return reinterpret_cast<void*>(aligned);
+    }
+
+    // Frees every block but the inline one. Nothing allocated before this may be used after.
+    void reset();
+
+private:
+    struct Block {
+        Block* next;
+    };
+
+    void* allocateBlock(size_t size, size_t align);
+
+    alignas(std::max_align_t) unsigned char _inline[inlineSize];
+    unsigned char* _cur;
+    unsigned char* _end;
+    Block* _blocks;
+    size_t _nextBlockSize;
+};
+
+// A standard allocator that takes its memory from an Arena, or from the heap if it doesn't
+// have one. Containers made with the default allocator behave exactly like their std::allocator
+// counterparts.
+//
+// Moving a container keeps its arena, but copying one puts the copy on the heap, so a copy is
+// always safe to keep around after the arena is reset.
+template<typename T>
+class ArenaAllocator {
+public:
+    using value_type = T;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+
+    ArenaAllocator() noexcept: _arena{nullptr} {}
+    ArenaAllocator(Arena* arena) noexcept: _arena{arena} {}
+    template<typename U>
+    ArenaAllocator(const ArenaAllocator<U>& other) noexcept: _arena{other.arena()} {}
+
+    T* allocate(size_t n) {
+        if (_arena == nullptr)
+            return static_cast<T*>(::operator new(n * sizeof(T)));
+        return static_cast<T*>(_arena->allocate(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T* p, size_t) noexcept {
+        if (_arena == nullptr)
+            ::operator delete(p);
+    }
+
+    ArenaAllocator select_on_container_copy_construction() const {
+        return ArenaAllocator();
+    }
+
+    Arena* arena() const { return _arena; }
+
+private:
+    Arena* _arena;
+};
+
+template<typename T, typename U>
+bool operator==(const ArenaAllocator<T>& lhs, const ArenaAllocator<U>& rhs) {
+    return lhs.arena() == rhs.arena();
+}
+
+template<typename T, typename U>
+bool operator!=(const ArenaAllocator<T>& lhs, const ArenaAllocator<U>& rhs) {
+    return lhs.arena() != rhs.arena();
+}
+
+template<typename T>
+using ArenaVector = std::vector<T, ArenaAllocator<T>>;
+
+} // namespace Memory
@@ -70,13 +70,12 @@ Packet::Packet(Type _type, Class _class, uint8_t _tag):
    data{},
    children{}
 {
-    children.reserve(2);
 }
 
-Packet::Packet(Type _type, Class _class, uint8_t _tag, std::string _value):
+Packet::Packet(Type _type, Class _class, uint8_t _tag, const std::string& _value):
     Packet(_type, _class, _tag)
 {
-    std::copy(_value.begin(), _value.end(), std::back_inserter(data));
+    data.assign(_value.begin(), _value.end());
 }
 
 Packet::Packet(Type _type, Class _class, uint8_t _tag, uint64_t _value):
@@ -88,13 +87,23 @@ Packet::Packet(Type _type, Class _class, uint8_t _tag, uint64_t _value):
 Packet::Packet(Type _type, Class _class, uint8_t _tag, bool _value):
     Packet(_type, _class, _tag)
 {
-    encodeInteger(_value ? 0 : 0xff, data);
+    // DER, and so every LDAP peer, wants TRUE as a single 0xff octet.
+    data.push_back(_value ? 0xff : 0x00);
 }
 
-Packet::Packet(Type _type, Class _class, uint8_t _tag, ByteVectorIt start, ByteVectorIt end):
+Packet::Packet(Type _type, Class _class, uint8_t _tag, ByteVectorCit start, ByteVectorCit end):
     Packet(_type, _class, _tag)
 {
-    std::copy(start, end, std::back_inserter(data));
+    data.assign(start, end);
+}
+
+Packet::Packet(Type _type, Class _class, uint8_t _tag, ByteVector&& _data):
+   type{_type},
+   berClass{_class},
+   tag{_tag},
+   data{std::move(_data)},
+   children{}
+{
 }
 
 void encodeInteger(int64_t val, ByteVector& out) {
@@ -117,49 +126,80 @@ void encodeInteger(int64_t val, ByteVector& out) {
     std::copy(curPos + 1, tmpOut.end(), std::back_inserter(out));
 }
 
-size_t Packet::length() {
-    size_t ret = data.size() + 2;
+namespace {
 
-    for (auto && c: children) {
-        auto childLen = c.length();
-        if (childLen > 127) {
-            for (size_t uintChildLen = childLen; ; uintChildLen >>= 8) {
-                childLen++;
-                if (uintChildLen < 0x80)
-                    break;
-            }
-        }
-        ret += childLen;
+// Returns the number of bytes it takes to encode a definite length of len.
+size_t lengthOfLength(size_t len) {
+    if (len < 128)
+        return 1;
+    size_t ret = 1;
+    for (; len > 0; len >>= 8) {
+        ret++;
     }
-
     return ret;
 }
 
-void Packet::copyBytes(ByteVector& out, bool topLevel) {
-    const auto len = length();
-    if (topLevel)
-        out.reserve(len);
+void appendLength(size_t len, ByteVector& out) {
+    if (len < 128) {
+        out.push_back(static_cast<uint8_t>(len));
+        return;
+    }
 
-    uint8_t metaByte = static_cast<uint8_t>(type);
-    metaByte |= static_cast<uint8_t>(berClass);
-    metaByte |= static_cast<uint8_t>(tag);
-    out.push_back(metaByte);
+    auto lenBytes = lengthOfLength(len) - 1;
+    out.push_back(static_cast<uint8_t>(lenBytes | 128));
+    for (auto shift = (lenBytes - 1) * 8; lenBytes > 0; lenBytes--, shift -= 8) {
+        out.push_back(static_cast<uint8_t>(len >> shift));
+    }
+}
 
-    ByteVector packetLen;
-    encodeInteger(len - 2, packetLen);
-    if (len > 127 || packetLen.size() > 1) {
-        out.push_back(static_cast<uint8_t>(packetLen.size() | 128));
+} // namespace
+
+size_t encodedLength(size_t contentLength) {
+    return 1 + lengthOfLength(contentLength) + contentLength;
+}
+
+void appendHeader(Type type, Class berClass, uint8_t tag, size_t contentLength,
+        ByteVector& out) {
+    out.push_back(static_cast<uint8_t>(type) | static_cast<uint8_t>(berClass) | tag);
+    appendLength(contentLength, out);
+}
+
+// Walks the tree once in pre-order, recording the content length of every node in
+// contentLengths and returning the total encoded length of this node.
+size_t Packet::measure(std::vector<size_t>& contentLengths) const {
+    auto idx = contentLengths.size();
+    contentLengths.push_back(0);
+
+    size_t contentLen = data.size();
+    for (const auto& c: children) {
+        contentLen += c.measure(contentLengths);
     }
+    contentLengths[idx] = contentLen;
 
-    std::copy(packetLen.begin(), packetLen.end(), std::back_inserter(out));
-    std::copy(data.begin(), data.end(), std::back_inserter(out));
-    for (auto && c: children) {
-        c.copyBytes(out, false);
+    return encodedLength(contentLen);
+}
+
+void Packet::encode(ByteVector& out, const std::vector<size_t>& contentLengths,
+        size_t& idx) const {
+    appendHeader(type, berClass, tag, contentLengths[idx++], out);
+    out.insert(out.end(), data.begin(), data.end());
+    for (const auto& c: children) {
+        c.encode(out, contentLengths, idx);
     }
 }
 
-void Packet::appendChild(Packet p) {
-    children.push_back(p);
+size_t Packet::length() const {
+    std::vector<size_t> contentLengths;
+    return measure(contentLengths);
+}
+
+void Packet::copyBytes(ByteVector& out) const {
+    std::vector<size_t> contentLengths;
+    auto len = measure(contentLengths);
+    out.reserve(out.size() + len);
+
+    size_t idx = 0;
+    encode(out, contentLengths, idx);
 }
 
 void Packet::print(int indent) {
@@ -212,7 +252,6 @@ Packet Packet::decode(ByteVectorIt bytes, ByteVectorIt& end) {
     uint8_t tag = meta & static_cast<int>(Tag::Bitmask);
     Class berClass = BITMASK_ENUM(meta, Class);
     Type type = BITMASK_ENUM(meta, Type);
-    Packet* ret = nullptr;
 
     // Get the data size
     uint64_t dataLen = decodeInteger(bytes, bytes + 1);
@@ -231,21 +270,16 @@ Packet Packet::decode(ByteVectorIt bytes, ByteVectorIt& end) {
         throw Ldap::Exception(Ldap::ErrorCode::protocolError);
     }
     end = bytes + dataLen;
-    if (type == Type::Constructed) {
-        ret = new Packet(type, berClass, tag);
-        while(bytes < end) {
-            ByteVectorIt childEnd = end;
-            auto child = Packet::decode(bytes, childEnd);
-            ret->appendChild(child);
-            bytes = childEnd;
-        }
-    } else {
-        ret = new Packet(type, berClass, tag, bytes, bytes + dataLen);
+    if (type != Type::Constructed)
+        return Packet(type, berClass, tag, bytes, bytes + dataLen);
+
+    Packet ret(type, berClass, tag);
+    while(bytes < end) {
+        ByteVectorIt childEnd = end;
+        ret.appendChild(Packet::decode(bytes, childEnd));
+        bytes = childEnd;
     }
-
-    // Use a unique_ptr to cleanup ret ptr when it goes out of scope
-    std::unique_ptr<Packet> cleanup(ret);
-    return *ret;
+    return ret;
 }
 
 Packet Packet::decode(uint8_t meta, ByteVector& reqBuffer) {
@@ -253,24 +287,118 @@ Packet Packet::decode(uint8_t meta, ByteVector& reqBuffer) {
     Class berClass = BITMASK_ENUM(meta, Class);
     Type type = BITMASK_ENUM(meta, Type);
 
-    Packet* ret = nullptr;
-    if (type == Type::Constructed) {
-        ret = new Packet(type, berClass, tag);
-        auto bytes = reqBuffer.begin();
-        auto end = reqBuffer.end();
-        while(bytes < end) {
-            ByteVectorIt childEnd = end;
-            auto child = Packet::decode(bytes, childEnd);
-            ret->appendChild(child);
-            bytes = childEnd;
+    if (type != Type::Constructed)
+        return Packet(type, berClass, tag, reqBuffer.begin(), reqBuffer.end());
+
+    Packet ret(type, berClass, tag);
+    auto bytes = reqBuffer.begin();
+    auto end = reqBuffer.end();
+    while(bytes < end) {
+        ByteVectorIt childEnd = end;
+        ret.appendChild(Packet::decode(bytes, childEnd));
+        bytes = childEnd;
+    }
+    return ret;
+}
+
+PacketView PacketView::decode(ByteVectorCit bytes, ByteVectorCit& end) {
+    // We need at least the metadata byte and the first size byte
+    if (end - bytes < 2) {
+        LOG_S(ERROR) << "BER packet header is longer than the available bytes";
+        throw Ldap::Exception(Ldap::ErrorCode::protocolError);
+    }
+
+    PacketView ret;
+    uint8_t meta = *bytes++;
+    ret.tag = meta & static_cast<int>(Tag::Bitmask);
+    ret.berClass = BITMASK_ENUM(meta, Class);
+    ret.type = BITMASK_ENUM(meta, Type);
+    // Multi-byte tags never show up in LDAP
+    if (ret.tag == static_cast<uint8_t>(Tag::Bitmask)) {
+        LOG_S(ERROR) << "BER packet has an unsupported multi-byte tag";
+        throw Ldap::Exception(Ldap::ErrorCode::protocolError);
+    }
+
+    uint64_t dataLen = *bytes++;
+    // If the data size is bigger than 127, the low bits are the size of the size
+    if ((dataLen & 128) != 0) {
+        dataLen -= 128;
+        if (dataLen == 0 || dataLen > sizeof(uint64_t) ||
+                static_cast<uint64_t>(end - bytes) < dataLen) {
+            LOG_S(ERROR) << "BER packet has an invalid long-form length";
+            throw Ldap::Exception(Ldap::ErrorCode::protocolError);
         }
-    } else {
-        ret = new Packet(type, berClass, tag, reqBuffer.begin(), reqBuffer.end());
+        auto realDataLen = decodeInteger(bytes, bytes + dataLen);
+        bytes += dataLen;
+        dataLen = realDataLen;
     }
 
-    // Use a unique_ptr to cleanup ret ptr when it goes out of scope
-    std::unique_ptr<Packet> cleanup(ret);
-    return *ret;
+    if (static_cast<uint64_t>(end - bytes) < dataLen) {
+        LOG_S(ERROR) << "End of BER packet is longer than the available bytes";
+        throw Ldap::Exception(Ldap::ErrorCode::protocolError);
+    }
+    end = bytes + dataLen;
+    ret.dataBegin = bytes;
+    ret.dataEnd = end;
+    return ret;
+}
+
+PacketView PacketView::decode(uint8_t meta, const ByteVector& reqBuffer) {
+    PacketView ret;
+    ret.tag = meta & static_cast<int>(Tag::Bitmask);
+    ret.berClass = BITMASK_ENUM(meta, Class);
+    ret.type = BITMASK_ENUM(meta, Type);
+    ret.dataBegin = reqBuffer.cbegin();
+    ret.dataEnd = reqBuffer.cend();
+    return ret;
+}
+
+PacketView::iterator PacketView::begin() const {
+    // Primative packets have no children, so their begin is their end.
+    if (type != Type::Constructed)
+        return iterator(dataEnd, dataEnd);
+    return iterator(dataBegin, dataEnd);
+}
+
+PacketView::iterator PacketView::end() const {
+    return iterator(dataEnd, dataEnd);
+}
+
+size_t PacketView::childCount() const {
+    size_t count = 0;
+    for (auto it = begin(); it != end(); ++it) {
+        count++;
+    }
+    return count;
+}
+
+PacketView PacketView::child(size_t n) const {
+    auto it = begin();
+    for (; it != end() && n > 0; ++it, --n);
+    Ldap::checkProtocolError(it != end());
+    return *it;
+}
+
+PacketView::iterator::iterator(ByteVectorCit _pos, ByteVectorCit _end):
+    pos{_pos},
+    end{_end},
+    next{_end},
+    cur{}
+{
+    decodeCurrent();
+}
+
+void PacketView::iterator::decodeCurrent() {
+    if (pos == end)
+        return;
+    next = end;
+    cur = PacketView::decode(pos, next);
+}
+
+PacketView::iterator& PacketView::iterator::operator++() {
+    pos = next;
+    decodeCurrent();
+    return *this;
 }
 
 } // namespace Ber
@@ -1,5 +1,10 @@
+#pragma once
+
 #include <stdint.h>
+#include <iterator>
 #include <memory>
+#include <string>
+#include <utility>
 #include <vector>
 
 namespace Ber {
@@ -58,34 +63,60 @@ using ByteVectorCit = ByteVector::const_iterator;
 void encodeInteger(int64_t val, ByteVector& out);
 uint64_t decodeInteger(ByteVectorCit begin, ByteVectorCit end);
 
+// For writing BER straight into a buffer without building a Packet tree, when the caller
+// already knows every element's content length.
+// Returns the length of an element on the wire, header included.
+size_t encodedLength(size_t contentLength);
+// Appends an element's identifier and length octets. Its content goes right after.
+void appendHeader(Type type, Class berClass, uint8_t tag, size_t contentLength,
+    ByteVector& out);
+
+// A Packet owns its data and its children. Building a tree allocates at most once per node
+// for its data and once per constructed node for its children if they're reserved up front,
+// as long as children are moved or emplaced in rather than copied.
 struct Packet {
-    Packet(Type _type, Class _class, uint8_t _tag, std::string _value);
+    Packet(Type _type, Class _class, uint8_t _tag, const std::string& _value);
     Packet(Type _type, Class _class, uint8_t _tag, uint64_t  _value);
     Packet(Type _type, Class _class, uint8_t _tag, bool _value);
-    Packet(Type _type, Class _class, uint8_t _tag, ByteVectorIt start, ByteVectorIt end);
+    Packet(Type _type, Class _class, uint8_t _tag, ByteVectorCit start, ByteVectorCit end);
+    // Takes over _data's buffer instead of copying it.
+    Packet(Type _type, Class _class, uint8_t _tag, ByteVector&& _data);
     Packet(Type _type, Class _class, uint8_t _tag);
 
     Packet(Type _type, Class _class, Tag _tag):
         Packet(_type, _class, static_cast<uint8_t>(_tag)) {};
-    Packet(Tag _tag, std::string _value):
+    Packet(Tag _tag, const std::string& _value):
         Packet(Type::Primative, Class::Universal, static_cast<uint8_t>(_tag), _value) {};
     Packet(Tag _tag, uint64_t  _value):
         Packet(Type::Primative, Class::Universal, static_cast<uint8_t>(_tag), _value) {};
     Packet(Tag _tag, bool _value):
         Packet(Type::Primative, Class::Universal, static_cast<uint8_t>(_tag), _value) {};
-    Packet(Tag _tag, ByteVectorIt start, ByteVectorIt end):
+    Packet(Tag _tag, ByteVectorCit start, ByteVectorCit end):
         Packet(Type::Primative, Class::Universal, static_cast<uint8_t>(_tag), start, end) {};
+    Packet(Tag _tag, ByteVector&& _data):
+        Packet(Type::Primative, Class::Universal, static_cast<uint8_t>(_tag),
+            std::move(_data)) {};
     Packet(Tag _tag):
         Packet(Type::Primative, Class::Universal, static_cast<uint8_t>(_tag)) {};
 
     static Packet decode(ByteVectorIt bytes, ByteVectorIt& end);
     static Packet decode(uint8_t meta, ByteVector& reqBuffer);
 
-    ~Packet() {};
-
-    void appendChild(Packet p);
-    size_t length();
-    void copyBytes(ByteVector& out, bool topLevel = true);
+    void appendChild(const Packet& p) { children.push_back(p); }
+    void appendChild(Packet&& p) { children.push_back(std::move(p)); }
+    // Builds the child in place from a Packet constructor's arguments. The reference is only
+    // good until the next child is added.
+    template<typename... Args>
+    Packet& emplaceChild(Args&&... args) {
+        children.emplace_back(std::forward<Args>(args)...);
+        return children.back();
+    }
+    void reserveChildren(size_t count) { children.reserve(count); }
+    // Returns the number of bytes this packet takes up on the wire, header included.
+    size_t length() const;
+    // Appends the encoded packet to out. Every node's length is computed exactly once and
+    // the bytes are written in a single pass.
+    void copyBytes(ByteVector& out) const;
     void print(int indent = 0);
 
     operator uint64_t() const { return Ber::decodeInteger(data.begin(), data.end()); }
@@ -101,6 +132,77 @@ struct Packet {
     uint8_t tag;
     ByteVector data;
     std::vector<Packet> children;
+
+private:
+    size_t measure(std::vector<size_t>& contentLengths) const;
+    void encode(ByteVector& out, const std::vector<size_t>& contentLengths, size_t& idx) const;
+};
+
+// PacketView is a read-only view of a BER packet that lives in a buffer owned by someone
+// else (usually the connection's reqBuffer). Decoding a view never allocates - the data is
+// referenced in place and constructed packets decode their children lazily as they're
+// iterated. The buffer must outlive every view into it.
+struct PacketView {
+    class iterator;
+
+    PacketView():
+        type{Type::Primative},
+        berClass{Class::Universal},
+        tag{0},
+        dataBegin{},
+        dataEnd{}
+    {}
+
+    static PacketView decode(ByteVectorCit bytes, ByteVectorCit& end);
+    static PacketView decode(uint8_t meta, const ByteVector& reqBuffer);
+
+    iterator begin() const;
+    iterator end() const;
+    size_t childCount() const;
+    // Returns the nth child, throwing a protocolError if there aren't that many.
+    PacketView child(size_t n) const;
+    size_t size() const { return dataEnd - dataBegin; }
+
+    operator uint64_t() const { return Ber::decodeInteger(dataBegin, dataEnd); }
+    operator std::string() const { return std::string(dataBegin, dataEnd); }
+    operator bool() const {
+        if (dataBegin == dataEnd)
+            return false;
+        return (*dataBegin != 0);
+    }
+
+    Type type;
+    Class berClass;
+    uint8_t tag;
+    ByteVectorCit dataBegin;
+    ByteVectorCit dataEnd;
+};
+
+class PacketView::iterator : public std::iterator<std::forward_iterator_tag, const PacketView>
+{
+public:
+    const PacketView& operator*() const { return cur; }
+    const PacketView* operator->() const { return &cur; }
+    iterator& operator++();
+    void operator++(int) { operator++(); }
+
+    bool operator==(const iterator& rhs) const {
+        return pos == rhs.pos;
+    }
+    bool operator!=(const iterator& rhs) const {
+        return pos != rhs.pos;
+    }
+
+private:
+    friend struct PacketView;
+    iterator(ByteVectorCit _pos, ByteVectorCit _end);
+
+    void decodeCurrent();
+
+    ByteVectorCit pos;
+    ByteVectorCit end;
+    ByteVectorCit next;
+    PacketView cur;
 };
 
 
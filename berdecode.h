@@ -0,0 +1,242 @@
+#pragma once
+
+#include <cstdint>
+#include <iterator>
+#include <limits>
+#include <string>
+#include <type_traits>
+
+#include "arena.h"
+#include "ber.h"
+#include "exceptions.h"
+
+namespace Ber {
+
+// Declarative decoders for BER messages. A message's shape is written down once as a type
+// built out of the templates below, and decode<Shape>() walks a PacketView against it. Every
+// identifier and element count is checked on the way, each field is stored straight into the
+// target struct, and anything that doesn't fit the shape is a protocolError. For example:
+//
+//     using PartialAttributeShape = Decode::Sequence<
+//         Decode::Field<Attribute, std::string, &Attribute::name, Decode::OctetString<>>,
+//         Decode::Field<Attribute, std::vector<std::string>, &Attribute::values,
+//             Decode::SetOf<Decode::OctetString<>>>>;
+//
+// Constructed elements nested in a Sequence decode into the same target as the Sequence, so
+// the struct doesn't have to mirror the ASN.1's nesting. Elements appended by SequenceOf and
+// SetOf are handed the arena if they take one, and their container is reserved up front so
+// growing it doesn't leave dead buffers behind in the arena.
+namespace Decode {
+
+namespace Detail {
+
+inline bool hasIdentifier(const PacketView& p, Type type, Class berClass, uint8_t tag) {
+    return p.type == type && p.berClass == berClass && p.tag == tag;
+}
+
+inline PacketView next(PacketView::iterator& it, const PacketView::iterator& end) {
+    Ldap::checkProtocolError(it != end);
+    auto ret = *it;
+    ++it;
+    return ret;
+}
+
+template<typename Out>
+typename std::enable_if<std::is_signed<Out>::value, bool>::type fits(int64_t value) {
+    return value >= std::numeric_limits<Out>::min() && value <= std::numeric_limits<Out>::max();
+}
+
+template<typename Out>
+typename std::enable_if<!std::is_signed<Out>::value, bool>::type fits(int64_t value) {
+    return value >= 0 && static_cast<uint64_t>(value) <= std::numeric_limits<Out>::max();
+}
+
+template<typename Container>
+typename std::enable_if<
+    std::is_constructible<typename Container::value_type, Memory::Arena*>::value>::type
+emplaceElement(Container& out, Memory::Arena* arena) {
+    out.emplace_back(arena);
+}
+
+template<typename Container>
+typename std::enable_if<
+    !std::is_constructible<typename Container::value_type, Memory::Arena*>::value>::type
+emplaceElement(Container& out, Memory::Arena*) {
+    out.emplace_back();
+}
+
+// Takes the next child for one element of a constructed type.
+template<typename Element>
+struct Next {
+    template<typename Target>
+    static void decode(PacketView::iterator& it, const PacketView::iterator& end,
+            Target& target, Memory::Arena* arena) {
+        auto child = next(it, end);
+        Ldap::checkProtocolError(Element::matches(child));
+        Element::decode(child, target, arena);
+    }
+};
+
+template<typename Target>
+void decodeElements(PacketView::iterator&, const PacketView::iterator&, Target&,
+    Memory::Arena*) {}
+
+template<typename Target, typename Element, typename... Rest>
+void decodeElements(PacketView::iterator& it, const PacketView::iterator& end,
+        Target& target, Memory::Arena* arena) {
+    Next<Element>::decode(it, end, target, arena);
+    decodeElements<Target, Rest...>(it, end, target, arena);
+}
+
+} // namespace Detail
+
+// Primitive values. Each decodes into whatever it's stored in.
+
+template<Class C = Class::Universal,
+    uint8_t TagNumber = static_cast<uint8_t>(Tag::OctetString)>
+struct OctetString {
+    static bool matches(const PacketView& p) {
+        return Detail::hasIdentifier(p, Type::Primative, C, TagNumber);
+    }
+    static void decode(const PacketView& p, std::string& out, Memory::Arena*) {
+        out = static_cast<std::string>(p);
+    }
+    static void decode(const PacketView& p, ByteVector& out, Memory::Arena*) {
+        out.assign(p.dataBegin, p.dataEnd);
+    }
+};
+
+struct Integer {
+    static bool matches(const PacketView& p) {
+        return Detail::hasIdentifier(p, Type::Primative, Class::Universal,
+            static_cast<uint8_t>(Tag::Integer));
+    }
+    // The value is two's complement in as many octets as it takes, so it's sign-extended from
+    // its own length. Anything that doesn't fit in Out is a protocolError.
+    template<typename Out>
+    static void decode(const PacketView& p, Out& out, Memory::Arena*) {
+        auto length = std::distance(p.dataBegin, p.dataEnd);
+        Ldap::checkProtocolError(length >= 1 && length <= 8);
+        auto bits = static_cast<uint64_t>(p);
+        int64_t value;
+        if ((*p.dataBegin & 0x80) == 0) {
+            value = static_cast<int64_t>(bits);
+        } else {
+            // Count up from the most negative value the length can hold.
+            auto magnitude = bits - (uint64_t{1} << (8 * length - 1));
+            value = std::numeric_limits<int64_t>::min() >> (64 - 8 * length);
+            value += static_cast<int64_t>(magnitude);
+        }
+        Ldap::checkProtocolError(Detail::fits<Out>(value));
+        out = static_cast<Out>(value);
+    }
+};
+
+struct Boolean {
+    static bool matches(const PacketView& p) {
+        return Detail::hasIdentifier(p, Type::Primative, Class::Universal,
+            static_cast<uint8_t>(Tag::Boolean));
+    }
+    static void decode(const PacketView& p, bool& out, Memory::Arena*) {
+        out = static_cast<bool>(p);
+    }
+};
+
+// An ENUMERATED whose values are the contiguous range [Min, Max] of E.
+template<typename E, E Min, E Max>
+struct Enumerated {
+    static bool matches(const PacketView& p) {
+        return Detail::hasIdentifier(p, Type::Primative, Class::Universal,
+            static_cast<uint8_t>(Tag::Enumerated));
+    }
+    static void decode(const PacketView& p, E& out, Memory::Arena*) {
+        auto value = static_cast<uint64_t>(p);
+        Ldap::checkProtocolError(value >= static_cast<uint64_t>(Min) &&
+            value <= static_cast<uint64_t>(Max));
+        out = static_cast<E>(value);
+    }
+};
+
+// Stores Value in one member of the struct being decoded.
+template<typename Struct, typename T, T Struct::*member, typename Value>
+struct Field {
+    static bool matches(const PacketView& p) { return Value::matches(p); }
+    static void decode(const PacketView& p, Struct& target, Memory::Arena* arena) {
+        Value::decode(p, target.*member, arena);
+    }
+};
+
+// Lets an element of a constructed type be left out. Its field keeps whatever it had.
+template<typename Element>
+struct Optional {};
+
+namespace Detail {
+
+template<typename Element>
+struct Next<Optional<Element>> {
+    template<typename Target>
+    static void decode(PacketView::iterator& it, const PacketView::iterator& end,
+            Target& target, Memory::Arena* arena) {
+        if (it != end && Element::matches(*it))
+            Next<Element>::decode(it, end, target, arena);
+    }
+};
+
+} // namespace Detail
+
+// A constructed element whose children are exactly Elements, in order.
+template<Class C, uint8_t TagNumber, typename... Elements>
+struct Constructed {
+    static bool matches(const PacketView& p) {
+        return Detail::hasIdentifier(p, Type::Constructed, C, TagNumber);
+    }
+    template<typename Target>
+    static void decode(const PacketView& p, Target& target, Memory::Arena* arena) {
+        auto it = p.begin();
+        const auto end = p.end();
+        Detail::decodeElements<Target, Elements...>(it, end, target, arena);
+        Ldap::checkProtocolError(it == end);
+    }
+};
+
+template<typename... Elements>
+using Sequence = Constructed<Class::Universal, static_cast<uint8_t>(Tag::Sequence),
+    Elements...>;
+
+template<uint8_t TagNumber, typename... Elements>
+using Application = Constructed<Class::Application, TagNumber, Elements...>;
+
+// A constructed element with any number of children that all match Element. Each one is
+// appended to a container.
+template<Class C, uint8_t TagNumber, typename Element>
+struct ConstructedOf {
+    static bool matches(const PacketView& p) {
+        return Detail::hasIdentifier(p, Type::Constructed, C, TagNumber);
+    }
+    template<typename Container>
+    static void decode(const PacketView& p, Container& out, Memory::Arena* arena) {
+        out.reserve(out.size() + p.childCount());
+        for (const auto& child: p) {
+            Ldap::checkProtocolError(Element::matches(child));
+            Detail::emplaceElement(out, arena);
+            Element::decode(child, out.back(), arena);
+        }
+    }
+};
+
+template<typename Element>
+using SequenceOf = ConstructedOf<Class::Universal, static_cast<uint8_t>(Tag::Sequence),
+    Element>;
+
+template<typename Element>
+using SetOf = ConstructedOf<Class::Universal, static_cast<uint8_t>(Tag::Set), Element>;
+
+// Decodes p, which must match Shape, into target.
+template<typename Shape, typename Target>
+void decode(const PacketView& p, Target& target, Memory::Arena* arena = nullptr) {
+    Ldap::checkProtocolError(Shape::matches(p));
+    Shape::decode(p, target, arena);
+}
+
+} // namespace Decode
+} // namespace Ber
@@ -0,0 +1,154 @@
+#include <stdexcept>
+
+#include <boost/algorithm/string.hpp>
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+
+#include "bindcache.h"
+#include "metrics.h"
+
+namespace Password {
+
+namespace {
+
+Metrics::Counter bindCacheHits{"bindCacheHits"};
+Metrics::Counter bindCacheMisses{"bindCacheMisses"};
+Metrics::Counter bindCacheEvictions{"bindCacheEvictions"};
+Metrics::Counter bindCacheInvalidations{"bindCacheInvalidations"};
+Metrics::Counter bindCacheEntries{"bindCacheEntries"};
+
+const size_t keyLength = 32;
+
+// DNs differ in case and spacing between requests, so invalidation can't rely on the
+// exact bytes the client sent.
+std::string normalizeDN(const std::string& dn) {
+    std::vector<std::string> parts;
+    boost::algorithm::split(parts, boost::algorithm::to_lower_copy(dn),
+        boost::algorithm::is_any_of(","));
+    for (auto& part: parts) {
+        auto eqPos = part.find('=');
+        if (eqPos == std::string::npos) {
+            boost::algorithm::trim(part);
+            continue;
+        }
+        part = boost::algorithm::trim_copy(part.substr(0, eqPos)) + "=" +
+            boost::algorithm::trim_copy(part.substr(eqPos + 1));
+    }
+    return boost::algorithm::join(parts, ",");
+}
+
+// Appends a length-prefixed field to the HMAC input so fields can't run into each other.
+void appendField(std::string& buf, const std::string& field) {
+    uint64_t size = field.size();
+    for (size_t i = 0; i < sizeof(size); i++) {
+        buf.push_back(static_cast<char>(size >> (8 * (7 - i))));
+    }
+    buf.append(field);
+}
+
+} // namespace
+
+BindCache::BindCache(std::chrono::seconds ttl, size_t maxEntries):
+    _ttl{ttl},
+    _maxEntries{maxEntries},
+    _key(keyLength),
+    _lock{},
+    _entries{},
+    _lru{},
+    _byDN{}
+{
+    if (RAND_bytes(_key.data(), _key.size()) != 1)
+        throw std::runtime_error("Error generating bind cache key");
+}
+
+std::string BindCache::digest(const std::string& dn, const std::string& hashedPassword,
+        const std::string& password) const {
+    std::string message;
+    appendField(message, normalizeDN(dn));
+    appendField(message, hashedPassword);
+    appendField(message, password);
+
+    uint8_t md[EVP_MAX_MD_SIZE];
+    unsigned int mdLength = 0;
+    HMAC(EVP_sha256(), _key.data(), _key.size(),
+        reinterpret_cast<const uint8_t*>(message.data()), message.size(), md, &mdLength);
+
+    return std::string(reinterpret_cast<char*>(md), mdLength);
+}
+
+void BindCache::erase(std::unordered_map<std::string, Node>::iterator it) {
+    auto range = _byDN.equal_range(it->second.dn);
+    for (auto dnIt = range.first; dnIt != range.second; ++dnIt) {
+        if (dnIt->second == it->first) {
+            _byDN.erase(dnIt);
+            break;
+        }
+    }
+    _lru.erase(it->second.lru);
+    _entries.erase(it);
+    bindCacheEntries.sub();
+}
+
+bool BindCache::verified(const std::string& dn, const std::string& hashedPassword,
+        const std::string& password) {
+    auto key = digest(dn, hashedPassword, password);
+
+    std::lock_guard<std::mutex> guard(_lock);
+    auto it = _entries.find(key);
+    if (it == _entries.end()) {
+        bindCacheMisses.add();
+        return false;
+    }
+    if (it->second.expires < std::chrono::steady_clock::now()) {
+        bindCacheMisses.add();
+        bindCacheEvictions.add();
+        erase(it);
+        return false;
+    }
+    bindCacheHits.add();
+    _lru.splice(_lru.begin(), _lru, it->second.lru);
+    return true;
+}
+
+void BindCache::remember(const std::string& dn, const std::string& hashedPassword,
+        const std::string& password) {
+    if (_maxEntries == 0)
+        return;
+    auto key = digest(dn, hashedPassword, password);
+    auto normalizedDN = normalizeDN(dn);
+    auto expires = std::chrono::steady_clock::now() + _ttl;
+
+    std::lock_guard<std::mutex> guard(_lock);
+    auto it = _entries.find(key);
+    if (it != _entries.end()) {
+        it->second.expires = expires;
+        _lru.splice(_lru.begin(), _lru, it->second.lru);
+        return;
+    }
+
+    while (_entries.size() >= _maxEntries) {
+        bindCacheEvictions.add();
+        erase(_entries.find(_lru.back()));
+    }
+    _lru.push_front(key);
+    _byDN.emplace(normalizedDN, key);
+    _entries.emplace(key, Node{normalizedDN, expires, _lru.begin()});
+    bindCacheEntries.add();
+}
+
+void BindCache::invalidate(const std::string& dn) {
+    std::lock_guard<std::mutex> guard(_lock);
+    auto range = _byDN.equal_range(normalizeDN(dn));
+    std::vector<std::string> keys;
+    for (auto it = range.first; it != range.second; ++it) {
+        keys.push_back(it->second);
+    }
+    for (const auto& key: keys) {
+        bindCacheInvalidations.add();
+        erase(_entries.find(key));
+    }
+}
+
+} // namespace Password
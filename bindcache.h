@@ -0,0 +1,60 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace Password {
+
+// BindCache remembers simple binds that recently succeeded, so a client that binds over and
+// over with the same password doesn't pay for PBKDF2 every time.
+//
+// Nothing secret is stored. Each verified bind is recorded as an HMAC, under a key generated
+// at startup, of the bind DN, the stored hash it was checked against and the password that
+// was presented. A different password or a changed userPassword produces a different digest
+// and simply misses. Entries also expire after a short TTL, are evicted least recently used
+// first past maxEntries, and are dropped by DN when userPassword is modified.
+class BindCache {
+public:
+    BindCache(std::chrono::seconds ttl, size_t maxEntries);
+    BindCache(const BindCache&) = delete;
+    BindCache& operator=(const BindCache&) = delete;
+
+    // Returns true if this exact password was checked against this stored hash recently.
+    bool verified(const std::string& dn, const std::string& hashedPassword,
+        const std::string& password);
+    // Records a successful checkPassword.
+    void remember(const std::string& dn, const std::string& hashedPassword,
+        const std::string& password);
+    // Forgets every bind for dn.
+    void invalidate(const std::string& dn);
+
+private:
+    struct Node {
+        std::string dn;
+        std::chrono::steady_clock::time_point expires;
+        std::list<std::string>::iterator lru;
+    };
+
+    std::string digest(const std::string& dn, const std::string& hashedPassword,
+        const std::string& password) const;
+    // Must be called with _lock held.
+    void erase(std::unordered_map<std::string, Node>::iterator it);
+
+    const std::chrono::seconds _ttl;
+    const size_t _maxEntries;
+    std::vector<uint8_t> _key;
+
+    std::mutex _lock;
+    std::unordered_map<std::string, Node> _entries;
+    // Digests, most recently used at the front.
+    std::list<std::string> _lru;
+    std::multimap<std::string, std::string> _byDN;
+};
+
+} // namespace Password
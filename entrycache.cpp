@@ -0,0 +1,135 @@
+#include <algorithm>
+#include <functional>
+
+#include "entrycache.h"
+#include "metrics.h"
+
+namespace Storage {
+
+namespace {
+
+Metrics::Counter cacheHits{"entryCacheHits"};
+Metrics::Counter cacheMisses{"entryCacheMisses"};
+Metrics::Counter cacheEvictions{"entryCacheEvictions"};
+Metrics::Counter cacheInvalidations{"entryCacheInvalidations"};
+Metrics::Counter cacheBytes{"entryCacheBytes"};
+Metrics::Counter cacheEntries{"entryCacheEntries"};
+
+// A rough count of the heap an entry takes up, including the cache's own bookkeeping.
+size_t entryBytes(const std::string& id, const Ldap::Entry& entry) {
+    const size_t nodeOverhead = 64;
+    size_t bytes = sizeof(Ldap::Entry) + nodeOverhead * 2 + id.size() * 2 + entry.dn.size();
+    for (const auto& attr: entry.attributes) {
+        bytes += nodeOverhead + attr.first.size() + sizeof(attr.second);
+        for (const auto& value: attr.second) {
+            bytes += sizeof(value) + value.size();
+        }
+    }
+    return bytes;
+}
+
+} // namespace
+
+EntryCache::EntryCache(size_t capacityBytes, size_t shardCount):
+    _shards{},
+    _shardCapacity{capacityBytes / std::max<size_t>(shardCount, 1)}
+{
+    if (_shardCapacity == 0)
+        return;
+    for (size_t i = 0; i < shardCount; i++) {
+        _shards.emplace_back(new Shard);
+    }
+}
+
+EntryCache::Shard& EntryCache::shardFor(const std::string& id) {
+    return *_shards[std::hash<std::string>()(id) % _shards.size()];
+}
+
+void EntryCache::Shard::erase(std::map<std::string, Node>::iterator it) {
+    bytes -= it->second.bytes;
+    cacheBytes.sub(it->second.bytes);
+    cacheEntries.sub();
+    lru.erase(it->second.lru);
+    entries.erase(it);
+}
+
+EntryCache::EntryPtr EntryCache::find(const std::string& id, uint64_t& generation) {
+    if (_shards.empty())
+        return nullptr;
+
+    auto& shard = shardFor(id);
+    std::lock_guard<std::mutex> guard(shard.lock);
+    generation = shard.generation;
+    auto it = shard.entries.find(id);
+    if (it == shard.entries.end()) {
+        cacheMisses.add();
+        return nullptr;
+    }
+    cacheHits.add();
+    shard.lru.splice(shard.lru.begin(), shard.lru, it->second.lru);
+    return it->second.entry;
+}
+
+void EntryCache::insert(const std::string& id, EntryPtr entry, uint64_t generation) {
+    if (_shards.empty())
+        return;
+    auto bytes = entryBytes(id, *entry);
+    if (bytes > _shardCapacity)
+        return;
+
+    auto& shard = shardFor(id);
+    std::lock_guard<std::mutex> guard(shard.lock);
+    if (shard.generation != generation)
+        return;
+
+    auto it = shard.entries.find(id);
+    if (it != shard.entries.end())
+        shard.erase(it);
+    while (shard.bytes + bytes > _shardCapacity) {
+        cacheEvictions.add();
+        shard.erase(shard.entries.find(shard.lru.back()));
+    }
+
+    shard.lru.push_front(id);
+    shard.entries[id] = Node{std::move(entry), bytes, shard.lru.begin()};
+    shard.bytes += bytes;
+    cacheBytes.add(bytes);
+    cacheEntries.add();
+}
+
+void EntryCache::invalidate(const std::string& id) {
+    if (_shards.empty())
+        return;
+
+    auto& shard = shardFor(id);
+    std::lock_guard<std::mutex> guard(shard.lock);
+    shard.generation++;
+    auto it = shard.entries.find(id);
+    if (it != shard.entries.end()) {
+        cacheInvalidations.add();
+        shard.erase(it);
+    }
+}
+
+void EntryCache::invalidateSubtree(const std::string& id) {
+    // Children hash to any shard, so this has to visit all of them. Within a shard, the
+    // subtree sorts between id + "," and id + "-".
+    for (auto& shardPtr: _shards) {
+        auto& shard = *shardPtr;
+        std::lock_guard<std::mutex> guard(shard.lock);
+        shard.generation++;
+        auto it = shard.entries.find(id);
+        if (it != shard.entries.end()) {
+            cacheInvalidations.add();
+            shard.erase(it);
+        }
+        it = shard.entries.lower_bound(id + ",");
+        auto end = shard.entries.lower_bound(id + "-");
+        while (it != end) {
+            cacheInvalidations.add();
+            shard.erase(it++);
+        }
+    }
+}
+
+} // namespace Storage
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "ldapproto.h"
+
+namespace Storage {
+
+// EntryCache is a process-wide, read-through cache of entries keyed by the storage id of
+// their normalized DN. It's split into shards, each with its own lock and LRU list, so
+// concurrent binds for different accounts rarely contend. The capacity is a budget of
+// approximate bytes, divided evenly between the shards.
+//
+// A miss that goes to the database can race with a write to the same entry. To keep a stale
+// read from being cached after the write invalidated it, find() hands out the shard's
+// generation, every invalidation bumps it, and insert() drops the entry if it changed.
+class EntryCache {
+public:
+    using EntryPtr = std::shared_ptr<const Ldap::Entry>;
+
+    // A capacity of zero disables the cache.
+    EntryCache(size_t capacityBytes, size_t shardCount = 16);
+    EntryCache(const EntryCache&) = delete;
+    EntryCache& operator=(const EntryCache&) = delete;
+
+    // Returns the cached entry, or nullptr on a miss. generation is set to the token to
+    // pass to insert() for whatever the caller loads in its place.
+    EntryPtr find(const std::string& id, uint64_t& generation);
+    void insert(const std::string& id, EntryPtr entry, uint64_t generation);
+
+    void invalidate(const std::string& id);
+    // Invalidates id and everything below it.
+    void invalidateSubtree(const std::string& id);
+
+private:
+    struct Node {
+        EntryPtr entry;
+        size_t bytes;
+        std::list<std::string>::iterator lru;
+    };
+
+    struct Shard {
+        std::mutex lock;
+        // Ordered so a subtree is a contiguous range of ids.
+        std::map<std::string, Node> entries;
+        // Most recently used at the front.
+        std::list<std::string> lru;
+        size_t bytes = 0;
+        uint64_t generation = 0;
+
+        void erase(std::map<std::string, Node>::iterator it);
+    };
+
+    Shard& shardFor(const std::string& id);
+
+    std::vector<std::unique_ptr<Shard>> _shards;
+    size_t _shardCapacity;
+};
+
+} // namespace Storage
@@ -0,0 +1,93 @@
+#include <algorithm>
+
+#include "loguru.hpp"
+
+#include "exceptions.h"
+#include "framer.h"
+
+namespace Ldap {
+
+MessageFramer::MessageFramer(size_t readSize, size_t maxMessageSize):
+    _buffer{},
+    _readPos{0},
+    _writePos{0},
+    _readSize{readSize},
+    _maxMessageSize{maxMessageSize},
+    _pendingSize{0}
+{}
+
+std::pair<uint8_t*, size_t> MessageFramer::prepare() {
+    // Slide whatever hasn't been consumed yet to the front of the buffer.
+    if (_readPos > 0) {
+        std::copy(_buffer.begin() + _readPos, _buffer.begin() + _writePos, _buffer.begin());
+        _writePos -= _readPos;
+        _readPos = 0;
+    }
+
+    auto wanted = std::max(_writePos + _readSize, _pendingSize);
+    if (_buffer.size() < wanted) {
+        _buffer.resize(wanted);
+    }
+
+    return std::make_pair(_buffer.data() + _writePos, _buffer.size() - _writePos);
+}
+
+void MessageFramer::release() {
+    if (buffered() > 0)
+        return;
+    Ber::ByteVector().swap(_buffer);
+    _readPos = 0;
+    _writePos = 0;
+}
+
+void MessageFramer::commit(size_t n) {
+    _writePos = std::min(_writePos + n, _buffer.size());
+}
+
+bool MessageFramer::next(Ber::PacketView& message) {
+    auto available = _writePos - _readPos;
+    if (available < 2)
+        return false;
+
+    const auto start = _buffer.cbegin() + _readPos;
+    // Every LDAPMessage is a universal constructed SEQUENCE
+    if (start[0] != (static_cast<uint8_t>(Ber::Type::Constructed) |
+                static_cast<uint8_t>(Ber::Tag::Sequence))) {
+        LOG_S(ERROR) << "Client sent a message that isn't a BER sequence";
+        throw Exception(ErrorCode::protocolError);
+    }
+
+    size_t headerLen = 2;
+    uint64_t dataLen = start[1];
+    if ((dataLen & 128) != 0) {
+        auto lenBytes = dataLen - 128;
+        if (lenBytes == 0 || lenBytes > sizeof(uint32_t)) {
+            LOG_S(ERROR) << "Client sent a message with an unsupported length encoding";
+            throw Exception(ErrorCode::protocolError);
+        }
+        headerLen += lenBytes;
+        if (available < headerLen)
+            return false;
+        dataLen = Ber::decodeInteger(start + 2, start + headerLen);
+    }
+
+    auto frameLen = headerLen + dataLen;
+    if (frameLen > _maxMessageSize) {
+        LOG_S(ERROR) << "Client sent a " << frameLen << " byte message, which is larger than "
+            << "the " << _maxMessageSize << " byte limit";
+        throw Exception(ErrorCode::protocolError);
+    }
+
+    if (available < frameLen) {
+        _pendingSize = frameLen;
+        return false;
+    }
+
+    auto end = start + frameLen;
+    message = Ber::PacketView::decode(start, end);
+    _readPos += frameLen;
+    _pendingSize = 0;
+    return true;
+}
+
+} // namespace Ldap
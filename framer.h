@@ -0,0 +1,47 @@
+#pragma once
+
+#include <utility>
+
+#include "ber.h"
+
+namespace Ldap {
+
+// MessageFramer sits between a connection's socket and the BER decoder. Reads go into one
+// large buffer, and each call to next() hands back one complete LDAPMessage from it. Partial
+// frames stay buffered until the rest of their bytes arrive, so a message split across TCP
+// segments and several pipelined messages in one segment are both handled.
+//
+// The buffer is linear rather than a true ring so that every message is contiguous and can
+// be handed out as a Ber::PacketView. Consumed bytes are reclaimed by sliding the unconsumed
+// tail to the front of the buffer in prepare(), which means views returned by next() are
+// only valid until the next call to prepare().
+class MessageFramer {
+public:
+    MessageFramer(size_t readSize = 16 * 1024, size_t maxMessageSize = 16 * 1024 * 1024);
+
+    // Returns the start and size of the free space to read into. The space is at least
+    // readSize bytes, or large enough to hold the rest of a partially buffered message.
+    std::pair<uint8_t*, size_t> prepare();
+    // Marks n bytes of the space returned by prepare() as filled.
+    void commit(size_t n);
+
+    // Pops the next complete message out of the buffer. Returns false if there isn't a
+    // complete message buffered yet. Throws a protocolError if the client sent something
+    // that can't be an LDAPMessage.
+    bool next(Ber::PacketView& message);
+
+    size_t buffered() const { return _writePos - _readPos; }
+    // Frees the buffer if nothing is buffered, so idle connections don't hold on to it.
+    void release();
+
+private:
+    Ber::ByteVector _buffer;
+    size_t _readPos;
+    size_t _writePos;
+    size_t _readSize;
+    size_t _maxMessageSize;
+    // The full size of the partially buffered message at _readPos, if we know it yet.
+    size_t _pendingSize;
+};
+
+} // namespace Ldap
@@ -0,0 +1,129 @@
+#include <algorithm>
+#include <sstream>
+
+#include "loguru.hpp"
+#include "hashpool.h"
+#include "metrics.h"
+#include "passwords.h"
+
+namespace Password {
+
+namespace {
+
+Metrics::Counter hashPoolQueued{"hashPoolQueued"};
+Metrics::Counter hashPoolPeakQueued{"hashPoolPeakQueued"};
+Metrics::Counter hashPoolCompleted{"hashPoolCompleted"};
+Metrics::Counter hashPoolRejected{"hashPoolRejected"};
+Metrics::Counter hashPoolBatches{"hashPoolBatches"};
+
+} // namespace
+
+HashPool::HashPool(size_t threads, size_t maxQueued, size_t maxBatch,
+        std::chrono::microseconds batchWindow):
+    _maxQueued{maxQueued},
+    _maxBatch{std::max<size_t>(maxBatch, 1)},
+    _batchWindow{batchWindow},
+    _lock{},
+    _wakeup{},
+    _queue{},
+    _stopping{false},
+    _threads{}
+{
+    for (size_t i = 0; i < threads; i++) {
+        _threads.emplace_back(&HashPool::worker, this, i);
+    }
+}
+
+HashPool::~HashPool() {
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        _stopping = true;
+    }
+    _wakeup.notify_all();
+    for (auto& t: _threads) {
+        t.join();
+    }
+}
+
+bool HashPool::submit(VerifyRequest request) {
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        if (_queue.size() >= _maxQueued) {
+            hashPoolRejected.add();
+            return false;
+        }
+        _queue.push_back(std::move(request));
+        hashPoolQueued.add();
+        hashPoolPeakQueued.max(_queue.size());
+    }
+    _wakeup.notify_one();
+    return true;
+}
+
+void HashPool::worker(size_t threadNum) {
+    std::stringstream threadName;
+    threadName << "hash " << threadNum;
+    loguru::set_thread_name(threadName.str().c_str());
+
+    for (;;) {
+        std::vector<VerifyRequest> batch;
+        {
+            std::unique_lock<std::mutex> guard(_lock);
+            _wakeup.wait(guard, [this]() {
+                return _stopping || !_queue.empty();
+            });
+            if (_queue.size() < _maxBatch && !_stopping && _batchWindow.count() > 0) {
+                _wakeup.wait_for(guard, _batchWindow, [this]() {
+                    return _stopping || _queue.size() >= _maxBatch;
+                });
+            }
+            // Another thread may have taken everything while we waited.
+            if (_queue.empty()) {
+                if (_stopping)
+                    return;
+                continue;
+            }
+            while (!_queue.empty() && batch.size() < _maxBatch) {
+                batch.push_back(std::move(_queue.front()));
+                _queue.pop_front();
+                hashPoolQueued.sub();
+            }
+        }
+
+        verify(batch);
+    }
+}
+
+void HashPool::verify(std::vector<VerifyRequest>& batch) {
+    std::vector<PasswordCheck> checks;
+    for (const auto& request: batch) {
+        for (const auto& hash: request.hashes) {
+            checks.push_back(PasswordCheck{request.password, hash, false, nullptr});
+        }
+    }
+    checkPasswords(checks);
+    hashPoolBatches.add();
+
+    auto check = checks.begin();
+    for (auto& request: batch) {
+        int matched = -1;
+        std::exception_ptr error;
+        for (size_t i = 0; i < request.hashes.size(); i++, ++check) {
+            if (check->matched && matched < 0)
+                matched = static_cast<int>(i);
+            if (check->error && !error)
+                error = check->error;
+        }
+        if (matched >= 0)
+            error = nullptr;
+
+        try {
+            request.done(matched, error);
+        } catch (const std::exception& e) {
+            LOG_S(ERROR) << "Unhandled error in hash thread: " << e.what();
+        }
+        hashPoolCompleted.add();
+    }
+}
+
+} // namespace Password
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace Password {
+
+struct VerifyRequest {
+    std::string password;
+    // The entry's userPassword values. The password is checked against all of them.
+    std::vector<std::string> hashes;
+    // Called on a pool thread with the index of the hash that matched, or -1 if none did.
+    // If nothing matched and a hash couldn't be checked, error is set as well.
+    std::function<void(int matched, std::exception_ptr error)> done;
+};
+
+// HashPool runs password verification on its own threads, so a burst of binds can only tie
+// up those threads and not the io threads serving everything else. The queue in front of it
+// is bounded: once maxQueued requests are waiting, submit() refuses more and the caller
+// should tell the client to back off.
+//
+// Each thread takes up to maxBatch requests at a time and checks them together with
+// checkPasswords, so their PBKDF2 chains can share SIMD lanes. If fewer are waiting, a
+// thread waits up to batchWindow for more to arrive before starting.
+class HashPool {
+public:
+    HashPool(size_t threads, size_t maxQueued, size_t maxBatch = 4,
+        std::chrono::microseconds batchWindow = std::chrono::microseconds(200));
+    ~HashPool();
+    HashPool(const HashPool&) = delete;
+    HashPool& operator=(const HashPool&) = delete;
+
+    // Returns false without queueing the request if the queue is full.
+    bool submit(VerifyRequest request);
+
+private:
+    void worker(size_t threadNum);
+    void verify(std::vector<VerifyRequest>& batch);
+
+    const size_t _maxQueued;
+    const size_t _maxBatch;
+    const std::chrono::microseconds _batchWindow;
+    std::mutex _lock;
+    std::condition_variable _wakeup;
+    std::deque<VerifyRequest> _queue;
+    bool _stopping;
+    std::vector<std::thread> _threads;
+};
+
+} // namespace Password
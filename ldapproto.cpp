@@ -1,3 +1,7 @@
+#include <map>
+#include <utility>
+
+#include "berdecode.h"
 #include "exceptions.h"
 #include "ldapproto.h"
 
@@ -10,12 +14,74 @@ Ber::Packet buildLdapResult(
 {
     Ber::Packet response(Ber::Type::Constructed, Ber::Class::Application,
         static_cast<uint8_t>(tag));
-    response.appendChild(Ber::Packet(Ber::Tag::Enumerated, static_cast<uint64_t>(code)));
-    response.appendChild(Ber::Packet(Ber::Tag::OctetString, matchedDn));
-    response.appendChild(Ber::Packet(Ber::Tag::OctetString, errMsg));
+    // Room for a BindResponse's serverSaslCreds too.
+    response.reserveChildren(4);
+    response.emplaceChild(Ber::Tag::Enumerated, static_cast<uint64_t>(code));
+    response.emplaceChild(Ber::Tag::OctetString, matchedDn);
+    response.emplaceChild(Ber::Tag::OctetString, errMsg);
     return response;
 };
 
+namespace {
+
+using ResultKey = std::pair<ErrorCode, MessageTag>;
+
+// The encoded LDAPResult bodies that go out most often. Built once and only read after.
+const std::map<ResultKey, Ber::ByteVector>& resultTemplates() {
+    static const std::map<ResultKey, Ber::ByteVector> templates = []() {
+        const ResultKey common[] = {
+            { ErrorCode::success, MessageTag::BindResponse },
+            { ErrorCode::success, MessageTag::SearchResDone },
+            { ErrorCode::success, MessageTag::ModifyResponse },
+            { ErrorCode::success, MessageTag::AddResponse },
+            { ErrorCode::success, MessageTag::DelResponse },
+            { ErrorCode::success, MessageTag::ModDNResponse },
+            { ErrorCode::success, MessageTag::ExtendedResponse },
+            { ErrorCode::compareTrue, MessageTag::CompareResponse },
+            { ErrorCode::compareFalse, MessageTag::CompareResponse },
+        };
+        std::map<ResultKey, Ber::ByteVector> built;
+        for (const auto& key: common) {
+            buildLdapResult(key.first, "", "", key.second).copyBytes(built[key]);
+        }
+        return built;
+    }();
+    return templates;
+}
+
+} // namespace
+
+Ber::ByteVector encodeLdapResult(uint64_t messageId, ErrorCode code, MessageTag tag) {
+    Ber::ByteVector uncached;
+    const Ber::ByteVector* body;
+    auto found = resultTemplates().find(ResultKey(code, tag));
+    if (found != resultTemplates().end()) {
+        body = &found->second;
+    } else {
+        buildLdapResult(code, "", "", tag).copyBytes(uncached);
+        body = &uncached;
+    }
+
+    // The shortest two's complement encoding of messageId, which is never negative.
+    size_t idLength = 1;
+    while (idLength < sizeof(messageId) + 1 && (messageId >> (8 * idLength - 1)) != 0)
+        idLength++;
+
+    auto contentLength = Ber::encodedLength(idLength) + body->size();
+    Ber::ByteVector out;
+    out.reserve(Ber::encodedLength(contentLength));
+    Ber::appendHeader(Ber::Type::Constructed, Ber::Class::Universal,
+        static_cast<uint8_t>(Ber::Tag::Sequence), contentLength, out);
+    Ber::appendHeader(Ber::Type::Primative, Ber::Class::Universal,
+        static_cast<uint8_t>(Ber::Tag::Integer), idLength, out);
+    for (auto i = idLength; i > 0; i--) {
+        auto shift = 8 * (i - 1);
+        out.push_back(shift < 64 ? static_cast<uint8_t>(messageId >> shift) : 0);
+    }
+    out.insert(out.end(), body->begin(), body->end());
+    return out;
+}
+
 template<typename T>
 void checkProtocolErrorTagMatches(T tagEnum, uint8_t tag) {
     uint8_t tagEnumByte = static_cast<uint8_t>(tagEnum);
@@ -28,74 +94,202 @@ void checkProtocolErrorTagRange(T tagMin, T tagMax, uint8_t val) {
             val <= static_cast<uint8_t>(tagMax));
 }
 
+// Pulls the next child out of a constructed packet, throwing a protocolError if the packet
+// has run out of children.
+Ber::PacketView nextChild(Ber::PacketView::iterator& it, const Ber::PacketView::iterator& end) {
+    checkProtocolError(it != end);
+    auto ret = *it;
+    ++it;
+    return ret;
+}
+
 void Entry::appendValue(std::string name, std::string value) {
     attributes[name].push_back(value);
 }
 
+namespace {
+
+bool isAlpha(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+bool isKeychar(char c) {
+    return isAlpha(c) || (c >= '0' && c <= '9') || c == '-';
+}
+
+} // namespace
+
+void checkAttributeDescription(const std::string& name) {
+    // attributedescription = descr *( ";" option ), where descr is a letter followed by
+    // keychars and each option is one or more keychars.
+    auto valid = !name.empty() && isAlpha(name[0]);
+    for (size_t i = 1; valid && i < name.size(); i++) {
+        if (name[i] == ';')
+            valid = (i + 1 < name.size() && name[i + 1] != ';');
+        else
+            valid = isKeychar(name[i]);
+    }
+    if (!valid) {
+        throw Exception(ErrorCode::undefinedAttributeType,
+            ("Invalid attribute description " + name).c_str());
+    }
+}
+
+namespace {
+
+namespace D = Ber::Decode;
+
+// Controls ::= SEQUENCE OF control Control, implicitly tagged [0] in an LDAPMessage.
+using ControlsShape = D::ConstructedOf<Ber::Class::Context, 0, D::Sequence<
+    D::Field<Control, std::string, &Control::oid, D::OctetString<>>,
+    D::Optional<D::Field<Control, bool, &Control::critical, D::Boolean>>,
+    D::Optional<D::Field<Control, Ber::ByteVector, &Control::value, D::OctetString<>>>>>;
+
+// PartialAttribute ::= SEQUENCE { type AttributeDescription, vals SET OF value }, decoded
+// into any struct with a string name and a vector of string values.
+template<typename Struct>
+using PartialAttributeShape = D::Sequence<
+    D::Field<Struct, std::string, &Struct::name, D::OctetString<>>,
+    D::Field<Struct, decltype(Struct::values), &Struct::values,
+        D::SetOf<D::OctetString<>>>>;
+
+} // namespace
+
+std::vector<Control> parseControls(const Ber::PacketView& p) {
+    std::vector<Control> ret;
+    D::decode<ControlsShape>(p, ret);
+    return ret;
+}
+
+Ber::Packet buildControls(const std::vector<Control>& controls) {
+    Ber::Packet ret(Ber::Type::Constructed, Ber::Class::Context, 0);
+    ret.reserveChildren(controls.size());
+    for (const auto& control: controls) {
+        auto& controlPacket = ret.emplaceChild(Ber::Type::Constructed, Ber::Class::Universal,
+            Ber::Tag::Sequence);
+        controlPacket.reserveChildren(3);
+        controlPacket.emplaceChild(Ber::Tag::OctetString, control.oid);
+        if (control.critical) {
+            controlPacket.emplaceChild(Ber::Tag::Boolean, true);
+        }
+        controlPacket.emplaceChild(Ber::Tag::OctetString, control.value.begin(),
+            control.value.end());
+    }
+    return ret;
+}
+
+namespace PagedResults {
+
+namespace {
+
+using ValueShape = D::Sequence<
+    D::Field<Value, uint64_t, &Value::size, D::Integer>,
+    D::Field<Value, std::string, &Value::cookie, D::OctetString<>>>;
+
+} // namespace
+
+Value::Value(const Ber::ByteVector& encoded) {
+    auto end = encoded.cend();
+    D::decode<ValueShape>(Ber::PacketView::decode(encoded.cbegin(), end), *this);
+}
+
+Ber::ByteVector Value::encode() const {
+    Ber::Packet p(Ber::Type::Constructed, Ber::Class::Universal, Ber::Tag::Sequence);
+    p.reserveChildren(2);
+    p.emplaceChild(Ber::Tag::Integer, size);
+    p.emplaceChild(Ber::Tag::OctetString, cookie);
+
+    Ber::ByteVector ret;
+    p.copyBytes(ret);
+    return ret;
+}
+
+} // namespace PagedResults
+
 namespace Bind {
 
-Request::Request(const Ber::Packet& p) {
+Request::Request(const Ber::PacketView& p) {
     checkProtocolErrorTagMatches<Ldap::MessageTag>(Ldap::MessageTag::BindRequest, p.tag);
-    checkProtocolErrorTagMatches<Ber::Tag>(Ber::Tag::Integer, p.children[0].tag);
-    version = p.children[0];
+    auto it = p.begin();
+    const auto end = p.end();
+
+    auto versionPacket = nextChild(it, end);
+    checkProtocolErrorTagMatches<Ber::Tag>(Ber::Tag::Integer, versionPacket.tag);
+    version = static_cast<uint64_t>(versionPacket);
 
-    checkProtocolErrorTagMatches<Ber::Tag>(Ber::Tag::OctetString, p.children[1].tag);
-    dn = std::string(p.children[1]);
+    auto dnPacket = nextChild(it, end);
+    checkProtocolErrorTagMatches<Ber::Tag>(Ber::Tag::OctetString, dnPacket.tag);
+    dn = std::string(dnPacket);
 
-    auto creds = p.children[2];
+    auto creds = nextChild(it, end);
     type = static_cast<Type>(creds.tag);
     checkProtocolError(type == Type::Simple || type == Type::Sasl);
     if (type == Type::Simple) {
         simple = std::string(creds);
     } else if (type == Type::Sasl) {
-        checkProtocolError(creds.children.size() == 1);
-        auto saslCreds = creds.children[0];
-        checkProtocolErrorTagMatches<Ber::Tag>(Ber::Tag::Sequence, saslCreds.tag);
-        checkProtocolError(creds.children.size() == 2);
-        saslMech = std::string(saslCreds.children[0]);
-        saslCredentials = saslCreds.children[1].data;
+        // SaslCredentials is implicitly tagged, so the mechanism and the optional
+        // credentials are children of the [3] itself.
+        auto count = creds.childCount();
+        checkProtocolError(count == 1 || count == 2);
+        auto mechPacket = creds.child(0);
+        checkProtocolErrorTagMatches<Ber::Tag>(Ber::Tag::OctetString, mechPacket.tag);
+        saslMech = std::string(mechPacket);
+        if (count == 2) {
+            auto saslData = creds.child(1);
+            checkProtocolErrorTagMatches<Ber::Tag>(Ber::Tag::OctetString, saslData.tag);
+            saslCredentials.assign(saslData.dataBegin, saslData.dataEnd);
+        }
     }
 }
 
 Response::Response(Ber::Packet result):
-    response(result)
+    response(std::move(result))
 { }
 
 void Response::appendSaslResponse(std::vector<uint8_t> resp) {
-    Ber::Packet saslData(Ber::Tag::OctetString, resp.begin(), resp.end());
-    response.appendChild(saslData);
+    // serverSaslCreds [7] OCTET STRING
+    response.emplaceChild(Ber::Type::Primative, Ber::Class::Context, 7, std::move(resp));
 }
 
 } // namespace bind
 
 namespace Search {
-Filter parseFilter(const Ber::Packet& p) {
-    Filter ret;
+Filter parseFilter(const Ber::PacketView& p, Memory::Arena* arena) {
+    Filter ret(arena);
     checkProtocolErrorTagRange<Filter::Type>(Filter::Type::And, Filter::Type::Extensible, p.tag);
     Filter::Type type = static_cast<Filter::Type>(p.tag);
     ret.type = type;
     switch(type) {
     case Filter::Type::And:
     case Filter::Type::Or:
-        checkProtocolError(p.children.size() >= 2);
-        for (const auto& c: p.children) {
-            ret.children.push_back(parseFilter(c));
+        ret.children.reserve(p.childCount());
+        for (const auto& c: p) {
+            ret.children.push_back(parseFilter(c, arena));
         }
+        checkProtocolError(ret.children.size() >= 2);
         break;
-    case Filter::Type::Not:
-        checkProtocolError(p.children.size() == 1);
-        ret.children.push_back(parseFilter(p.children[0]));
+    case Filter::Type::Not: {
+        auto it = p.begin();
+        ret.children.reserve(1);
+        ret.children.push_back(parseFilter(nextChild(it, p.end()), arena));
+        checkProtocolError(it == p.end());
+        }
         break;
-    case Filter::Type::Sub:
-        checkProtocolError(p.children.size() == 2);
-        ret.attributeName = std::string(p.children[0]);
-        for (const auto& c: p.children[1].children) {
+    case Filter::Type::Sub: {
+        auto it = p.begin();
+        const auto end = p.end();
+        ret.attributeName = std::string(nextChild(it, end));
+        auto subPacket = nextChild(it, end);
+        ret.subChildren.reserve(subPacket.childCount());
+        for (const auto& c: subPacket) {
             SubFilter sf {
                 static_cast<SubFilter::Type>(c.tag),
                 std::string(c)
             };
             ret.subChildren.push_back(sf);
         }
+        checkProtocolError(it == end);
+        }
         break;
     case Filter::Type::Extensible:
         break;
@@ -105,89 +299,123 @@ Filter parseFilter(const Ber::Packet& p) {
     case Filter::Type::Eq:
     case Filter::Type::Gte:
     case Filter::Type::Lte:
-    case Filter::Type::Approx:
-        checkProtocolError(p.children.size() == 2);
-        ret.attributeName = std::string(p.children[0]);
-        ret.value = std::string{ p.children[1].data.begin(), p.children[1].data.end() };
+    case Filter::Type::Approx: {
+        auto it = p.begin();
+        const auto end = p.end();
+        ret.attributeName = std::string(nextChild(it, end));
+        ret.value = std::string(nextChild(it, end));
+        checkProtocolError(it == end);
+        }
         break;
     }
 
     return ret;
 }
 
-Request::Request(const Ber::Packet p) {
-    // Basic sanity checks
-    checkProtocolErrorTagMatches<Ldap::MessageTag>(Ldap::MessageTag::SearchRequest, p.tag);
-    checkProtocolError(p.children.size() == 8);
-
-    checkProtocolErrorTagMatches<Ber::Tag>(Ber::Tag::OctetString, p.children[0].tag);
-    base = std::string(p.children[0]);
-
-    checkProtocolErrorTagMatches<Ber::Tag>(Ber::Tag::Enumerated, p.children[1].tag);
-    checkProtocolErrorTagRange<Scope>(Scope::Base, Scope::Sub, static_cast<uint64_t>(p.children[1]));
-    scope = static_cast<Scope>(static_cast<uint64_t>(p.children[1]));
-
-    checkProtocolErrorTagMatches<Ber::Tag>(Ber::Tag::Enumerated, p.children[2].tag);
-    checkProtocolErrorTagRange<DerefAliases>(DerefAliases::Never, DerefAliases::Always,
-            static_cast<uint64_t>(p.children[2]));
-    derefAliases = static_cast<DerefAliases>(static_cast<uint64_t>(p.children[2]));
-
-    checkProtocolErrorTagMatches<Ber::Tag>(Ber::Tag::Integer, p.children[3].tag);
-    sizeLimit = p.children[3];
+namespace {
 
-    checkProtocolErrorTagMatches<Ber::Tag>(Ber::Tag::Integer, p.children[4].tag);
-    timeLimit = p.children[4];
-
-    checkProtocolErrorTagMatches<Ber::Tag>(Ber::Tag::Boolean, p.children[5].tag);
-    typesOnly = p.children[5];
-
-    filter = parseFilter(p.children[6]);
-
-    checkProtocolErrorTagMatches<Ber::Tag>(Ber::Tag::Sequence, p.children[7].tag);
-    for (const auto& a: p.children[7].children) {
-        checkProtocolErrorTagMatches<Ber::Tag>(Ber::Tag::OctetString, a.tag);
-        attributes.emplace_back(static_cast<std::string>(a));
+// Filters are a recursive CHOICE, so they're still parsed by hand.
+struct FilterChoice {
+    static bool matches(const Ber::PacketView& p) {
+        return p.berClass == Ber::Class::Context;
+    }
+    static void decode(const Ber::PacketView& p, Filter& out, Memory::Arena* arena) {
+        out = parseFilter(p, arena);
     }
+};
+
+using RequestShape = D::Application<static_cast<uint8_t>(MessageTag::SearchRequest),
+    D::Field<Request, std::string, &Request::base, D::OctetString<>>,
+    D::Field<Request, Request::Scope, &Request::scope,
+        D::Enumerated<Request::Scope, Request::Scope::Base, Request::Scope::Sub>>,
+    D::Field<Request, Request::DerefAliases, &Request::derefAliases,
+        D::Enumerated<Request::DerefAliases, Request::DerefAliases::Never,
+            Request::DerefAliases::Always>>,
+    D::Field<Request, int, &Request::sizeLimit, D::Integer>,
+    D::Field<Request, int, &Request::timeLimit, D::Integer>,
+    D::Field<Request, bool, &Request::typesOnly, D::Boolean>,
+    D::Field<Request, Filter, &Request::filter, FilterChoice>,
+    D::Field<Request, Memory::ArenaVector<std::string>, &Request::attributes,
+        D::SequenceOf<D::OctetString<>>>>;
+
+} // namespace
+
+Request::Request(const Ber::PacketView& p, Memory::Arena* arena):
+    filter{arena},
+    attributes{arena}
+{
+    D::decode<RequestShape>(p, *this, arena);
 }
 
 
 Ber::Packet generateResult(const Ldap::Entry& entry) {
     Ber::Packet response(Ber::Type::Constructed, Ber::Class::Application, 4);
-    response.appendChild(Ber::Packet(Ber::Tag::OctetString, entry.dn));
+    response.reserveChildren(2);
+    response.emplaceChild(Ber::Tag::OctetString, entry.dn);
 
-    Ber::Packet attrRoot(Ber::Type::Constructed, Ber::Class::Universal, Ber::Tag::Sequence);
+    auto& attrRoot = response.emplaceChild(Ber::Type::Constructed, Ber::Class::Universal,
+        Ber::Tag::Sequence);
+    attrRoot.reserveChildren(entry.attributes.size());
     for (const auto& attr: entry.attributes) {
-        Ber::Packet attrPacket(Ber::Type::Constructed, Ber::Class::Universal, Ber::Tag::Sequence);
-        attrPacket.appendChild(Ber::Packet(Ber::Tag::OctetString, attr.first));
-        Ber::Packet attrValues(Ber::Type::Constructed, Ber::Class::Universal, Ber::Tag::Set);
+        auto& attrPacket = attrRoot.emplaceChild(Ber::Type::Constructed, Ber::Class::Universal,
+            Ber::Tag::Sequence);
+        attrPacket.reserveChildren(2);
+        attrPacket.emplaceChild(Ber::Tag::OctetString, attr.first);
+        auto& attrValues = attrPacket.emplaceChild(Ber::Type::Constructed,
+            Ber::Class::Universal, Ber::Tag::Set);
+        attrValues.reserveChildren(attr.second.size());
         for (const auto& val: attr.second) {
-            Ber::Packet valPacket(Ber::Tag::OctetString, val);
-            attrValues.appendChild(valPacket);
+            attrValues.emplaceChild(Ber::Tag::OctetString, val);
         }
-        attrPacket.appendChild(attrValues);
-        attrRoot.appendChild(attrPacket);
     }
-    response.appendChild(attrRoot);
     return response;
 }
 
 } // namespace search
 
 namespace Add {
-Entry parseRequest(Ber::Packet p) {
-    checkProtocolErrorTagMatches<Ldap::MessageTag>(Ldap::MessageTag::AddRequest, p.tag);
-    checkProtocolErrorTagMatches<Ber::Tag>(Ber::Tag::OctetString, p.children[0].tag);
-    Entry ret(p.children[0]);
-
-    Ber::Packet attrs = p.children[1];
-    checkProtocolErrorTagMatches<Ber::Tag>(Ber::Tag::Sequence, attrs.tag);
-    for (const auto& attrSeq: attrs.children) {
-        checkProtocolErrorTagMatches<Ber::Tag>(Ber::Tag::Sequence, attrSeq.tag);
-        checkProtocolErrorTagMatches<Ber::Tag>(Ber::Tag::OctetString, attrSeq.children[0].tag);
-        checkProtocolErrorTagMatches<Ber::Tag>(Ber::Tag::Set, attrSeq.children[1].tag);
-        for (const auto& attrVal: attrSeq.children[1].children) {
-            checkProtocolErrorTagMatches<Ber::Tag>(Ber::Tag::OctetString, attrVal.tag);
-            ret.appendValue(attrSeq.children[0], attrVal);
+
+namespace {
+
+// The values go on the heap, since they're moved into the Entry as they are.
+struct Attribute {
+    std::string name;
+    std::vector<std::string> values;
+};
+
+struct Request {
+    std::string dn;
+    Memory::ArenaVector<Attribute> attributes;
+
+    explicit Request(Memory::Arena* arena):
+        dn{},
+        attributes{arena}
+    { }
+};
+
+using RequestShape = D::Application<static_cast<uint8_t>(MessageTag::AddRequest),
+    D::Field<Request, std::string, &Request::dn, D::OctetString<>>,
+    D::Field<Request, Memory::ArenaVector<Attribute>, &Request::attributes,
+        D::SequenceOf<PartialAttributeShape<Attribute>>>>;
+
+} // namespace
+
+Entry parseRequest(const Ber::PacketView& p, Memory::Arena* arena) {
+    Request req(arena);
+    D::decode<RequestShape>(p, req, arena);
+
+    Entry ret(std::move(req.dn));
+    for (auto& attr: req.attributes) {
+        checkAttributeDescription(attr.name);
+        // Repeated attributes are merged. Only move the values into a new key, since emplace
+        // may move them out even when the key is already there.
+        auto existing = ret.attributes.find(attr.name);
+        if (existing == ret.attributes.end()) {
+            ret.attributes.emplace(std::move(attr.name), std::move(attr.values));
+        } else {
+            auto& values = existing->second;
+            values.insert(values.end(), std::make_move_iterator(attr.values.begin()),
+                std::make_move_iterator(attr.values.end()));
         }
     }
     return ret;
@@ -196,48 +424,39 @@ Entry parseRequest(Ber::Packet p) {
 } // namespace add
 
 namespace Delete {
-std::string parseRequest(Ber::Packet p) {
-    checkProtocolErrorTagMatches<Ldap::MessageTag>(Ldap::MessageTag::DelRequest, p.tag);
-    return static_cast<std::string>(p);
+
+std::string parseRequest(const Ber::PacketView& p) {
+    using RequestShape = D::OctetString<Ber::Class::Application,
+        static_cast<uint8_t>(MessageTag::DelRequest)>;
+    std::string dn;
+    D::decode<RequestShape>(p, dn);
+    return dn;
 }
 
 } // namespace delete
 
 namespace Modify {
-Modification::Modification(const Ber::Packet p) {
-    checkProtocolErrorTagMatches<Ber::Tag>(Ber::Tag::Sequence, p.tag);
-    checkProtocolError(p.children.size() == 2);
-
-    checkProtocolErrorTagMatches<Ber::Tag>(Ber::Tag::Enumerated, p.children[0].tag);
-    type = static_cast<Type>(static_cast<uint64_t>(p.children[0]));
-
-    checkProtocolErrorTagMatches<Ber::Tag>(Ber::Tag::Sequence, p.children[1].tag);
-    auto partialAttr = p.children[1];
-    checkProtocolError(partialAttr.children.size() == 2);
 
-    checkProtocolErrorTagMatches<Ber::Tag>(Ber::Tag::OctetString, partialAttr.children[0].tag);
-    name = static_cast<std::string>(partialAttr.children[0]);
+namespace {
 
-    auto attrList = partialAttr.children[1];
-    checkProtocolErrorTagMatches<Ber::Tag>(Ber::Tag::Set, attrList.tag);
-    for (const auto& val: attrList.children) {
-        checkProtocolErrorTagMatches<Ber::Tag>(Ber::Tag::OctetString, val.tag);
-        values.push_back(static_cast<std::string>(val));
-    }
-}
+using RequestShape = D::Application<static_cast<uint8_t>(MessageTag::ModifyRequest),
+    D::Field<Request, std::string, &Request::dn, D::OctetString<>>,
+    D::Field<Request, Memory::ArenaVector<Modification>, &Request::mods,
+        D::SequenceOf<D::Sequence<
+            D::Field<Modification, Modification::Type, &Modification::type,
+                D::Enumerated<Modification::Type, Modification::Type::Add,
+                    Modification::Type::Replace>>,
+            PartialAttributeShape<Modification>>>>>;
 
-Request::Request(const Ber::Packet p) {
-    checkProtocolErrorTagMatches<Ldap::MessageTag>(Ldap::MessageTag::ModifyRequest, p.tag);
-    checkProtocolError(p.children.size() == 2);
-
-    checkProtocolErrorTagMatches<Ber::Tag>(Ber::Tag::OctetString, p.children[0].tag);
-    dn = static_cast<std::string>(p.children[0]);
-
-    checkProtocolErrorTagMatches<Ber::Tag>(Ber::Tag::Sequence, p.children[1].tag);
-    for (const auto& modPacket: p.children[1].children) {
-        mods.emplace_back(modPacket);
-    }
+} // namespace
 
+Request::Request(const Ber::PacketView& p, Memory::Arena* arena):
+    dn{},
+    mods{arena}
+{
+    D::decode<RequestShape>(p, *this, arena);
+    for (const auto& mod: mods)
+        checkAttributeDescription(mod.name);
 }
 
 } //namespace modif
@@ -1,10 +1,14 @@
+#pragma once
+
 #include <vector>
 #include <memory>
 #include <string>
 #include <map>
 #include <iterator>
 
+#include "arena.h"
 #include "ber.h"
+#include "exceptions.h"
 
 namespace Ldap {
     enum class MessageTag : uint8_t {
@@ -48,12 +52,54 @@ namespace Ldap {
         void appendValue(std::string name, std::string value);
     };
 
+    // Throws undefinedAttributeType unless name is an RFC 4512 attribute description whose
+    // type is a descriptor, like cn or cn;lang-en. Those are the only names the backend can
+    // store as they are: a numeric OID's dots would be read as a path, and names starting
+    // with an underscore are the backend's own fields.
+    void checkAttributeDescription(const std::string& name);
+
     Ber::Packet buildLdapResult(
         Ldap::ErrorCode code,
         std::string matchedDn,
         std::string errMsg,
         MessageTag tag);
 
+    // Encodes a whole LDAPMessage carrying an LDAPResult with an empty matchedDN and
+    // diagnosticMessage. The common (code, tag) pairs are encoded once and only the
+    // messageId is spliced in.
+    Ber::ByteVector encodeLdapResult(uint64_t messageId, ErrorCode code, MessageTag tag);
+
+    struct Control {
+        std::string oid;
+        bool critical;
+        Ber::ByteVector value;
+    };
+
+    // Parses the optional [0] Controls element of an LDAPMessage
+    std::vector<Control> parseControls(const Ber::PacketView& p);
+    // Builds the [0] Controls element to append to an LDAPMessage
+    Ber::Packet buildControls(const std::vector<Control>& controls);
+
+namespace PagedResults {
+
+    // RFC 2696 Simple Paged Results Manipulation
+    const std::string Oid = "1.2.840.113556.1.4.319";
+
+    struct Value {
+        uint64_t size;
+        std::string cookie;
+
+        Value(uint64_t _size, std::string _cookie):
+            size(_size),
+            cookie(std::move(_cookie))
+        { }
+
+        Value(const Ber::ByteVector& encoded);
+        Ber::ByteVector encode() const;
+    };
+
+} // namespace PagedResults
+
 namespace Search {
 
     struct SubFilter {
@@ -63,12 +109,22 @@ namespace Search {
 
     struct Filter {
         enum class Type { And, Or, Not, Eq, Sub, Gte, Lte, Present, Approx, Extensible } type;
-        std::vector<Filter> children;
-        std::vector<SubFilter> subChildren;
+        Memory::ArenaVector<Filter> children;
+        Memory::ArenaVector<SubFilter> subChildren;
         std::string value;
         std::string attributeName;
+
+        explicit Filter(Memory::Arena* arena = nullptr):
+            type{Type::Present},
+            children{arena},
+            subChildren{arena},
+            value{},
+            attributeName{}
+        { }
     };
 
+    // The request's filter tree and attribute list are allocated from arena if it's given,
+    // so they must not outlive it.
     struct Request {
         std::string base;
         enum class Scope { Base, One, Sub } scope;
@@ -77,9 +133,9 @@ namespace Search {
         int timeLimit;
         bool typesOnly;
         Filter filter;
-        std::vector<std::string> attributes;
+        Memory::ArenaVector<std::string> attributes;
 
-        Request(const Ber::Packet p);
+        Request(const Ber::PacketView& p, Memory::Arena* arena = nullptr);
     };
 
     Ber::Packet generateResult(const Ldap::Entry& e);
@@ -89,17 +145,23 @@ namespace Search {
 namespace Modify {
 
     struct Modification {
-        Modification(const Ber::Packet p);
         enum class Type { Add, Delete, Replace } type;
-        std::vector<std::string> values;
+        Memory::ArenaVector<std::string> values;
         std::string name;
+
+        explicit Modification(Memory::Arena* arena = nullptr):
+            type{Type::Add},
+            values{arena},
+            name{}
+        { }
     };
 
+    // Like a SearchRequest, the modifications come out of arena if it's given.
     struct Request {
         std::string dn;
-        std::vector<Modification> mods;
+        Memory::ArenaVector<Modification> mods;
 
-        Request(const Ber::Packet p);
+        Request(const Ber::PacketView& p, Memory::Arena* arena = nullptr);
     };
 
 } //namespace Modify
@@ -115,7 +177,7 @@ namespace Bind {
 
         enum class Type { Simple = 0, Sasl = 3 } type;
 
-        Request(const Ber::Packet& p);
+        Request(const Ber::PacketView& p);
     };
 
     struct Response {
@@ -127,10 +189,10 @@ namespace Bind {
 } // namespace bind
 
 namespace Add {
-    Ldap::Entry parseRequest(Ber::Packet p);
+    Ldap::Entry parseRequest(const Ber::PacketView& p, Memory::Arena* arena = nullptr);
 } // namespace Add
 
 namespace Delete {
-    std::string parseRequest(Ber::Packet p);
+    std::string parseRequest(const Ber::PacketView& p);
 } // namespace Delete
 } // namespace Ldap
@@ -1,248 +1,103 @@
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
 #include <ctime>
+#include <functional>
 #include <iostream>
+#include <memory>
+#include <set>
+#include <sstream>
 #include <string>
 #include <thread>
 #include <asio.hpp>
-#include <cctype>
 #include <utility>
-#include <set>
+#include <vector>
 
+#include <boost/algorithm/string.hpp>
 #include <yaml-cpp/yaml.h>
 #include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "loguru.hpp"
-#include "exceptions.h"
-#include "ldapproto.h"
-#include "storage.h"
 #include "passwords.h"
+#include "scram.h"
+#include "session.h"
 
 using asio::ip::tcp;
 YAML::Node config;
 
-void sendResponse(tcp::socket& sock, uint64_t messageId, Ber::Packet response) {
-    Ber::Packet envelope(
-        Ber::Type::Constructed, Ber::Class::Universal, Ber::Tag::Sequence);
-    envelope.appendChild(Ber::Packet(Ber::Tag::Integer, messageId));
-    envelope.appendChild(response);
-
-    std::vector<uint8_t> bytes;
-    bytes.reserve(envelope.length());
-    envelope.copyBytes(bytes);
-    sock.send(asio::buffer(bytes));
+std::string describePeer(tcp::socket& sock) {
+    asio::error_code error;
+    std::stringstream peer;
+    peer << sock.remote_endpoint(error);
+    return peer.str();
 }
 
-void session_thread(tcp::socket sock) {
-    std::stringstream threadName;
-    threadName << sock.remote_endpoint();
-    loguru::set_thread_name(threadName.str().c_str());
-    auto db = Storage::Mongo::MongoBackend{
-        "mongodb://localhost",
-        "directory",
-        "rootdn",
-        "dc=mongodb,dc=com"
-    };
+Server::PeerCredentials peerCredentials(tcp::socket&) {
+    return Server::PeerCredentials{};
+}
 
-    bool noAuthentication = false;
-    // Put this into its own scope so the YAML nodes get cleaned up.
-    {
-        auto check = config["noAuthentication"];
-        if (check && check.as<bool>() == true)
-            noAuthentication = true;
+// Local peers are who the kernel says they are, which is the whole point of ldapi.
+Server::PeerCredentials peerCredentials(asio::local::stream_protocol::socket& sock) {
+    struct ucred cred;
+    socklen_t length = sizeof(cred);
+    Server::PeerCredentials ret;
+    if (getsockopt(sock.native_handle(), SOL_SOCKET, SO_PEERCRED, &cred, &length) == 0) {
+        ret.known = true;
+        ret.pid = cred.pid;
+        ret.uid = cred.uid;
+        ret.gid = cred.gid;
+    } else {
+        LOG_S(ERROR) << "Error getting ldapi peer credentials: " << strerror(errno);
     }
+    return ret;
+}
 
-    bool userBound = false;
-    std::string userBoundDN;
-
-    for (;;)
-    {
-        std::vector<uint8_t> header(2);;
-        size_t length;
-        asio::error_code error;
+std::string describePeer(asio::local::stream_protocol::socket& sock) {
+    auto credentials = peerCredentials(sock);
+    std::stringstream peer;
+    peer << "ldapi pid " << credentials.pid << " uid " << credentials.uid;
+    return peer.str();
+}
 
-        length = sock.read_some(asio::buffer(header), error);
+template <typename Protocol>
+void acceptConnections(asio::io_service& ioService, asio::io_service& operationService,
+        asio::basic_socket_acceptor<Protocol>& acceptor,
+        const Server::SessionOptions& options, Storage::Mongo::MongoBackend& db) {
+    auto sock = std::make_shared<typename Protocol::socket>(ioService);
+    acceptor.async_accept(*sock, [&ioService, &operationService, &acceptor, &options, &db,
+            sock](const asio::error_code& error) {
         if (error) {
-            if (error == asio::error::eof)
-                break;
-            else
-                throw asio::system_error(error);
-        }
-        if (length != header.size()) {
-            LOG_F(ERROR, "Client sent malformed BER header");
-            break;
-        }
-
-        std::vector<uint8_t> reqBuffer;
-        reqBuffer.reserve(1024);
-        if ((header[1] & 128) != 0) {
-            header[1] -= 128;
-            reqBuffer.resize(header[1]);
-            length = sock.read_some(asio::buffer(reqBuffer), error);
-            if (length != reqBuffer.size()) {
-                LOG_F(ERROR, "Client sent mal-formed BER size header");
-                break;
-            }
-            auto decodedReqSize = Ber::decodeInteger(reqBuffer.cbegin(), reqBuffer.cend());
-            reqBuffer.resize(decodedReqSize, 0);
+            LOG_S(ERROR) << "Error accepting connection: " << error.message();
         } else {
-            reqBuffer.resize(header[1], 0);
-        }
-        length = sock.read_some(asio::buffer(reqBuffer), error);
-        if (length != reqBuffer.size()) {
-            LOG_F(ERROR, "Client sent fewer bytes than expected");
-            break;
+            try {
+                auto peer = describePeer(*sock);
+                auto credentials = peerCredentials(*sock);
+                std::make_shared<Server::Session>(ioService, operationService,
+                    asio::generic::stream_protocol::socket(std::move(*sock)),
+                    std::move(peer), credentials, options, db)->start();
+            } catch (const std::exception& e) {
+                LOG_S(ERROR) << "Error starting session: " << e.what();
+            }
         }
+        acceptConnections(ioService, operationService, acceptor, options, db);
+    });
+}
 
-        auto ber = Ber::Packet::decode(header[0], reqBuffer);
-        auto messageId = static_cast<uint64_t>(ber.children[0]);
-        auto messageType = Ldap::MessageTag { static_cast<Ldap::MessageTag>(ber.children[1].tag) };
-
-        Ldap::MessageTag errorResponseType;
-        switch (messageType) {
-        case Ldap::MessageTag::SearchRequest:
-            errorResponseType = Ldap::MessageTag::SearchResDone;
-            break;
-        default:
-            errorResponseType = static_cast<Ldap::MessageTag>(static_cast<uint8_t>(messageType) + 1);
-            break;
-        }
+// Runs ioService's handlers. kind names the thread in the logs, e.g. "io 3".
+void serviceThread(asio::io_service& ioService, const std::string& kind, size_t threadNum) {
+    std::stringstream threadName;
+    threadName << kind << " " << threadNum;
+    loguru::set_thread_name(threadName.str().c_str());
+    for (;;) {
         try {
-            if (messageType == Ldap::MessageTag::BindRequest) {
-                Ldap::Bind::Request bindReq(ber.children[1]);
-                if (bindReq.type == Ldap::Bind::Request::Type::Sasl) {
-                // TODO SUPPORT SASL BINDS!
-                    throw Ldap::Exception(Ldap::ErrorCode::authMethodNotSupported);
-                }
-
-                bool passOkay = false;
-                if (noAuthentication) {
-                    LOG_S(INFO)
-                        << "Authentication is disabled, sending bogus bind for "
-                        << bindReq.dn;
-                    passOkay = true;
-                } else {
-                    LOG_S(INFO) << "Authenticating " << bindReq.dn;
-                    try {
-                        auto entry = db.findEntry(bindReq.dn);
-                        for (const auto& pass: entry->attributes.at("userPassword")) {
-                            passOkay = Password::checkPassword(bindReq.simple, pass);
-                            if (passOkay)
-                                break;
-                        }
-
-                    } catch (Ldap::Exception e) {
-                        LOG_S(ERROR) << "Error during authentication " << e.what();
-                        if (e == Ldap::ErrorCode::noSuchObject) {
-                            throw Ldap::Exception(Ldap::ErrorCode::invalidCredentials);
-                        }
-                        throw;
-                    }
-                }
-
-                Ldap::ErrorCode respCode;
-                if (passOkay) {
-                    respCode = Ldap::ErrorCode::success;
-                    userBound = true;
-                    userBoundDN = bindReq.dn;
-                } else {
-                    respCode = Ldap::ErrorCode::invalidCredentials;
-                    userBound = false;
-                    userBoundDN = "";
-                }
-
-                Ldap::Bind::Response bindResp(Ldap::buildLdapResult(respCode, bindReq.dn, "",
-                            Ldap::MessageTag::BindResponse));
-                sendResponse(sock, messageId, bindResp.response);
-            }
-            else if (messageType == Ldap::MessageTag::SearchRequest) {
-                Ldap::Search::Request searchReq(ber.children[1]);
-                auto cursor = db.findEntries(searchReq);
-
-                for (const auto& entry: *cursor) {
-                    sendResponse(sock, messageId, Ldap::Search::generateResult(entry));
-                }
-
-                sendResponse(sock, messageId,
-                    Ldap::buildLdapResult(Ldap::ErrorCode::success,
-                        "", "", Ldap::MessageTag::SearchResDone));
-            }
-            else if (messageType == Ldap::MessageTag::AddRequest) {
-                Ldap::Entry entry = Ldap::Add::parseRequest(ber.children[1]);
-                db.saveEntry(entry, true);
-                sendResponse(sock, messageId,
-                    Ldap::buildLdapResult(Ldap::ErrorCode::success,
-                        "", "", Ldap::MessageTag::AddResponse));
-            }
-            else if (messageType == Ldap::MessageTag::ModifyRequest) {
-                Ldap::Modify::Request req(ber.children[1]);
-                auto entry = db.findEntry(req.dn);
-                if (entry == nullptr) {
-                    throw Ldap::Exception(Ldap::ErrorCode::noSuchObject);
-                }
-                for (const auto& mod: req.mods) {
-                    using ModType = Ldap::Modify::Modification::Type;
-                    switch(mod.type) {
-                    case ModType::Add:
-                        for (const auto& v: mod.values) {
-                            entry->appendValue(mod.name, v);
-                        }
-                        break;
-                    case ModType::Delete:
-                        if (mod.values.size() == 0) {
-                            if (entry->attributes.erase(mod.name) == 0) {
-                                throw Ldap::Exception(Ldap::ErrorCode::noSuchAttribute);
-                            }
-                        } else {
-                            try {
-                                auto curVals = entry->attributes.at(mod.name);
-                                std::set<std::string> finalVals(curVals.begin(), curVals.end());
-                                for (const auto& v: mod.values) {
-                                    if (finalVals.erase(v) == 0) {
-                                        throw Ldap::Exception(Ldap::ErrorCode::noSuchAttribute);
-                                    }
-                                }
-                                curVals.clear();
-                                std::copy(finalVals.begin(), finalVals.end(),
-                                    std::back_inserter(curVals));
-                            } catch(std::out_of_range) {
-                                throw Ldap::Exception(Ldap::ErrorCode::noSuchAttribute);
-                            }
-                        }
-                        break;
-                    case ModType::Replace:
-                        if (mod.values.size() == 0) {
-                            entry->attributes.erase(mod.name);
-                        } else {
-                            entry->attributes[mod.name] = mod.values;
-                        }
-                        break;
-                    }
-                }
-                db.saveEntry(*entry, false);
-                sendResponse(sock, messageId,
-                    Ldap::buildLdapResult(Ldap::ErrorCode::success,
-                        "", "", Ldap::MessageTag::ModifyResponse));
-            }
-            else if (messageType == Ldap::MessageTag::DelRequest) {
-                std::string dn = Ldap::Delete::parseRequest(ber.children[1]);
-                db.deleteEntry(dn);
-                sendResponse(sock, messageId,
-                    Ldap::buildLdapResult(Ldap::ErrorCode::success,
-                        "", "", Ldap::MessageTag::DelResponse));
-            }
-        } catch (const Ldap::Exception& e) {
-            auto resPacket = Ldap::buildLdapResult(e, "", e.what(), errorResponseType);
-            sendResponse(sock, messageId, resPacket);
-            break;
+            ioService.run();
+            return;
         } catch (const std::exception& e) {
-            auto resPacket = Ldap::buildLdapResult(Ldap::ErrorCode::other,
-                "", e.what(), errorResponseType);
-            sendResponse(sock, messageId, resPacket);
-            break;
-        } catch (...) {
-            auto resPacket = Ldap::buildLdapResult(Ldap::ErrorCode::other,
-                "", "Unknown error occurred", errorResponseType);
-            sendResponse(sock, messageId, resPacket);
-            break;
+            LOG_S(ERROR) << "Unhandled error in " << kind << " thread: " << e.what();
         }
     }
 }
@@ -259,13 +114,173 @@ int main(int argc, char** argv)
         if (config["port"]) {
             port = config["port"].as<int>();
         }
+        Server::SessionOptions sessionOptions;
+        // Put this into its own scope so the YAML nodes get cleaned up.
+        {
+            auto check = config["noAuthentication"];
+            if (check && check.as<bool>() == true)
+                sessionOptions.noAuthentication = true;
+        }
+        if (config["maxInFlightPerConnection"]) {
+            sessionOptions.maxInFlight = std::max<size_t>(1,
+                config["maxInFlightPerConnection"].as<size_t>());
+        }
+        if (config["pagedSearchTimeout"]) {
+            sessionOptions.pagedSearchTimeout =
+                std::chrono::seconds(config["pagedSearchTimeout"].as<int>());
+        }
+        // V2 at the default rounds is preferred unless the config says otherwise. Binds
+        // against hashes from any other scheme or with fewer rounds get rehashed.
+        if (config["passwords"]) {
+            auto passwordConfig = config["passwords"];
+            if (passwordConfig["rounds"]) {
+                Password::registerScheme(Password::Pbkdf2Scheme::v2(
+                    passwordConfig["rounds"].as<uint32_t>()));
+            }
+            if (passwordConfig["scramIterations"]) {
+                Password::registerScheme(std::make_shared<Password::ScramScheme>(
+                    passwordConfig["scramIterations"].as<uint32_t>()));
+            }
+            if (passwordConfig["scheme"]) {
+                Password::setPreferredScheme(passwordConfig["scheme"].as<std::string>());
+            }
+            sessionOptions.rehashPasswords =
+                passwordConfig["rehashOnBind"].as<bool>(sessionOptions.rehashPasswords);
+        }
+        LOG_S(INFO) << "Hashing new passwords with "
+            << Password::preferredScheme()->name();
+        // Caching verified binds is off unless the config asks for it.
+        std::unique_ptr<Password::BindCache> bindCache;
+        if (config["bindCache"]) {
+            auto bindCacheConfig = config["bindCache"];
+            bindCache.reset(new Password::BindCache(
+                std::chrono::seconds(bindCacheConfig["ttlSeconds"].as<int>(60)),
+                bindCacheConfig["maxEntries"].as<size_t>(10000)));
+            sessionOptions.bindCache = bindCache.get();
+        }
+        // Password hashing gets its own threads so a flood of binds can't starve the io
+        // threads. Default to half the cores.
+        size_t hashThreads = std::max<size_t>(1, std::thread::hardware_concurrency() / 2);
+        size_t hashQueueSize = 256;
+        size_t hashBatchSize = 4;
+        int hashBatchWindowUS = 200;
+        if (config["passwordHashing"]) {
+            auto hashConfig = config["passwordHashing"];
+            hashThreads = std::max<size_t>(1, hashConfig["threads"].as<size_t>(hashThreads));
+            hashQueueSize = hashConfig["queueSize"].as<size_t>(hashQueueSize);
+            hashBatchSize = hashConfig["batchSize"].as<size_t>(hashBatchSize);
+            hashBatchWindowUS = hashConfig["batchWindowUS"].as<int>(hashBatchWindowUS);
+        }
+        Password::HashPool hashPool(hashThreads, hashQueueSize, hashBatchSize,
+            std::chrono::microseconds(hashBatchWindowUS));
+        sessionOptions.hashPool = &hashPool;
+
+        if (config["maxPagedSearchesPerConnection"]) {
+            sessionOptions.maxPagedSearches = std::max<size_t>(1,
+                config["maxPagedSearchesPerConnection"].as<size_t>());
+        }
+
+        // Connections are multiplexed over a fixed pool of io threads rather than getting
+        // a thread each, so default to one thread per core.
+        size_t ioThreads = std::thread::hardware_concurrency();
+        if (config["ioThreads"]) {
+            ioThreads = config["ioThreads"].as<size_t>();
+        }
+        if (ioThreads == 0) {
+            ioThreads = 1;
+        }
+        // Requests run on threads of their own, since they block on mongo and the io threads
+        // must not. They spend most of their time waiting, so default to a few per core, and
+        // to enough that one connection's in-flight requests can't take them all.
+        size_t operationThreads = std::max<size_t>(
+            4 * std::thread::hardware_concurrency(), 2 * sessionOptions.maxInFlight);
+        if (config["operationThreads"]) {
+            operationThreads = std::max<size_t>(1, config["operationThreads"].as<size_t>());
+        }
+        asio::io_service operationService;
+        // Keep the operation threads running while there's nothing for them to do.
+        asio::io_service::work operationWork(operationService);
+
+        // Every session shares one backend, and with it one pool of mongo clients.
+        Storage::Mongo::PoolOptions poolOptions;
+        size_t entryCacheBytes = 64 * 1024 * 1024;
+        std::set<std::string> normalizedAttributes;
+        Storage::Mongo::Schema schema;
+        std::string mongoURI = "mongodb://localhost";
+        std::string mongoDB = "directory";
+        std::string mongoCollection = "rootdn";
+        std::string rootDN = "dc=mongodb,dc=com";
+        if (config["mongodb"]) {
+            auto mongoConfig = config["mongodb"];
+            mongoURI = mongoConfig["uri"].as<std::string>(mongoURI);
+            mongoDB = mongoConfig["database"].as<std::string>(mongoDB);
+            mongoCollection = mongoConfig["collection"].as<std::string>(mongoCollection);
+            rootDN = mongoConfig["rootDN"].as<std::string>(rootDN);
+            poolOptions.minPoolSize =
+                mongoConfig["minPoolSize"].as<int>(poolOptions.minPoolSize);
+            poolOptions.maxPoolSize =
+                mongoConfig["maxPoolSize"].as<int>(poolOptions.maxPoolSize);
+            poolOptions.waitQueueTimeoutMS =
+                mongoConfig["waitQueueTimeoutMS"].as<int>(poolOptions.waitQueueTimeoutMS);
+            entryCacheBytes = mongoConfig["entryCacheBytes"].as<size_t>(entryCacheBytes);
+            // Attributes to match case-insensitively and index for substring searches.
+            if (mongoConfig["normalizedAttributes"]) {
+                for (const auto& attr: mongoConfig["normalizedAttributes"]) {
+                    normalizedAttributes.insert(
+                        boost::algorithm::to_lower_copy(attr.as<std::string>()));
+                }
+            }
+            // Attribute syntaxes to store as typed values, e.g. uidNumber: integer.
+            if (mongoConfig["schema"]) {
+                for (const auto& attr: mongoConfig["schema"]) {
+                    schema[boost::algorithm::to_lower_copy(attr.first.as<std::string>())] =
+                        Storage::Mongo::parseSyntax(attr.second.as<std::string>());
+                }
+            }
+        }
+        Storage::Mongo::MongoBackend db(mongoURI, mongoDB, mongoCollection, rootDN, poolOptions,
+            entryCacheBytes, normalizedAttributes, schema);
+        db.prepareCollection();
+
         tcp::acceptor acceptor(io_service, tcp::endpoint(tcp::v4(), port));
+        acceptConnections(io_service, operationService, acceptor, sessionOptions, db);
 
-        for (;;)
-        {
-            tcp::socket socket(io_service);
-            acceptor.accept(socket);
-            std::thread(session_thread, std::move(socket)).detach();
+        // The ldapi socket is off unless the config gives it a path. Anyone who can connect
+        // to it can bind with SASL EXTERNAL as externalDN, so its permissions matter.
+        std::unique_ptr<asio::local::stream_protocol::acceptor> ldapiAcceptor;
+        if (config["ldapi"]) {
+            auto ldapiConfig = config["ldapi"];
+            auto path = ldapiConfig["path"].as<std::string>();
+            auto mode = std::stoul(ldapiConfig["mode"].as<std::string>("0666"), nullptr, 8);
+            sessionOptions.externalDNTemplate = ldapiConfig["externalDN"].as<std::string>(
+                sessionOptions.externalDNTemplate);
+
+            // A socket left behind by a previous run would make bind() fail.
+            unlink(path.c_str());
+            ldapiAcceptor.reset(new asio::local::stream_protocol::acceptor(io_service,
+                asio::local::stream_protocol::endpoint(path)));
+            if (chmod(path.c_str(), mode) != 0) {
+                throw std::runtime_error("Couldn't set the mode of " + path + ": " +
+                    strerror(errno));
+            }
+            acceptConnections(io_service, operationService, *ldapiAcceptor, sessionOptions,
+                db);
+            LOG_S(INFO) << "Listening on ldapi socket " << path << ", EXTERNAL binds as "
+                << sessionOptions.externalDNTemplate;
+        }
+
+        LOG_S(INFO) << "Listening on port " << port << " with " << ioThreads << " io threads and "
+            << operationThreads << " operation threads";
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < operationThreads; i++) {
+            threads.emplace_back(serviceThread, std::ref(operationService), "operation", i);
+        }
+        for (size_t i = 1; i < ioThreads; i++) {
+            threads.emplace_back(serviceThread, std::ref(io_service), "io", i);
+        }
+        serviceThread(io_service, "io", 0);
+        for (auto& t: threads) {
+            t.join();
         }
     }
     catch (std::exception& e)
@@ -0,0 +1,50 @@
+#include <algorithm>
+#include <mutex>
+
+#include "metrics.h"
+
+namespace Metrics {
+namespace {
+
+struct Registry {
+    std::mutex lock;
+    std::vector<const Counter*> counters;
+};
+
+// Counters are constructed during static initialization, so the registry has to be
+// constructed on first use rather than being a static itself.
+Registry& registry() {
+    static Registry reg;
+    return reg;
+}
+
+} // namespace
+
+Counter::Counter(std::string name):
+    _name{std::move(name)},
+    _value{0}
+{
+    auto& reg = registry();
+    std::lock_guard<std::mutex> guard(reg.lock);
+    reg.counters.push_back(this);
+}
+
+void Counter::max(int64_t val) {
+    auto cur = _value.load(std::memory_order_relaxed);
+    while (cur < val && !_value.compare_exchange_weak(cur, val, std::memory_order_relaxed));
+}
+
+std::vector<std::pair<std::string, int64_t>> snapshot() {
+    std::vector<std::pair<std::string, int64_t>> ret;
+    {
+        auto& reg = registry();
+        std::lock_guard<std::mutex> guard(reg.lock);
+        for (const auto c: reg.counters) {
+            ret.emplace_back(c->name(), c->value());
+        }
+    }
+    std::sort(ret.begin(), ret.end());
+    return ret;
+}
+
+} // namespace Metrics
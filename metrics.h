@@ -0,0 +1,35 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace Metrics {
+
+// A named, process-wide counter. Counters register themselves when they're constructed, so
+// they should be defined as statics next to the code that updates them. Updates are a single
+// relaxed atomic add, cheap enough to do on every request.
+class Counter {
+public:
+    explicit Counter(std::string name);
+    Counter(const Counter&) = delete;
+    Counter& operator=(const Counter&) = delete;
+
+    void add(int64_t n = 1) { _value.fetch_add(n, std::memory_order_relaxed); }
+    void sub(int64_t n = 1) { _value.fetch_sub(n, std::memory_order_relaxed); }
+    // Raises the counter to val if it's currently lower, for tracking high-water marks.
+    void max(int64_t val);
+    int64_t value() const { return _value.load(std::memory_order_relaxed); }
+    const std::string& name() const { return _name; }
+
+private:
+    const std::string _name;
+    std::atomic<int64_t> _value;
+};
+
+// Returns the name and current value of every registered counter, sorted by name.
+std::vector<std::pair<std::string, int64_t>> snapshot();
+
+} // namespace Metrics
@@ -1,6 +1,18 @@
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <limits>
+#include <stdexcept>
 #include <string>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <set>
 #include <sstream>
+#include <vector>
 
 #include <boost/algorithm/string.hpp>
 #include <boost/tokenizer.hpp>
@@ -8,6 +20,8 @@
 
 #include <mongocxx/client.hpp>
 #include <mongocxx/instance.hpp>
+#include <mongocxx/pipeline.hpp>
+#include <mongocxx/pool.hpp>
 #include <mongocxx/uri.hpp>
 #include <mongocxx/exception/exception.hpp>
 
@@ -21,6 +35,7 @@
 
 #include "exceptions.h"
 #include "ldapproto.h"
+#include "metrics.h"
 #include "storage.h"
 
 namespace Storage {
@@ -32,6 +47,47 @@ using bsoncxx::builder::basic::kvp;
 using bsoncxx::builder::basic::sub_document;
 using bsoncxx::builder::basic::sub_array;
 
+namespace {
+
+Metrics::Counter poolAcquired{"mongoPoolAcquired"};
+Metrics::Counter poolInUse{"mongoPoolInUse"};
+Metrics::Counter poolPeakInUse{"mongoPoolPeakInUse"};
+Metrics::Counter poolWaits{"mongoPoolWaits"};
+Metrics::Counter poolTimeouts{"mongoPoolTimeouts"};
+
+// The pool options are only settable through the connection string, so tack them on to
+// whatever the config file gave us.
+std::string poolURI(std::string connectURI, const PoolOptions& options) {
+    const std::string schemeSep = "://";
+    auto hostStart = connectURI.find(schemeSep);
+    hostStart = (hostStart == std::string::npos) ? 0 : hostStart + schemeSep.size();
+    if (connectURI.find('?') == std::string::npos) {
+        if (connectURI.find('/', hostStart) == std::string::npos) {
+            connectURI.push_back('/');
+        }
+        connectURI.push_back('?');
+    } else {
+        connectURI.push_back('&');
+    }
+
+    std::stringstream uriBuf;
+    uriBuf << connectURI
+        << "minPoolSize=" << options.minPoolSize
+        << "&maxPoolSize=" << options.maxPoolSize;
+    if (options.waitQueueTimeoutMS > 0) {
+        uriBuf << "&waitQueueTimeoutMS=" << options.waitQueueTimeoutMS;
+    }
+    return uriBuf.str();
+}
+
+// The driver requires exactly one instance per process, created before any clients.
+mongocxx::instance& driverInstance() {
+    static mongocxx::instance instance{};
+    return instance;
+}
+
+} // namespace
+
 std::list<std::string> dnToList(std::string dn) {
     std::list<std::string> dnParts;
 
@@ -65,44 +121,628 @@ std::string dnPartsToId(const std::list<std::string>& parts) {
     return boost::algorithm::join(reversedList, ",");
 }
 
+Syntax parseSyntax(const std::string& name) {
+    using boost::algorithm::iequals;
+    if (iequals(name, "integer"))
+        return Syntax::Integer;
+    if (iequals(name, "generalizedTime"))
+        return Syntax::GeneralizedTime;
+    if (iequals(name, "boolean"))
+        return Syntax::Boolean;
+    if (iequals(name, "dn"))
+        return Syntax::DN;
+    throw std::invalid_argument("unknown attribute syntax " + name);
+}
+
+namespace {
+
+// Stores where an entry sits in the tree, so one-level searches can look up children by
+// their parent instead of scanning the whole subtree.
+void appendTreeFields(std::list<std::string> dnParts, sub_document& doc) {
+    auto depth = static_cast<int32_t>(dnParts.size());
+    if (!dnParts.empty())
+        dnParts.pop_front();
+    doc.append(kvp("_parent", dnPartsToId(dnParts)));
+    doc.append(kvp("_depth", depth));
+}
+
+// Fields starting with an underscore are ours, not attributes of the entry.
+bool isInternalField(const std::string& key) {
+    return !key.empty() && key[0] == '_';
+}
+
+// Everything below an entry has an _id that starts with the entry's _id followed by a comma,
+// and '-' is the next character after ',', so the subtree is a range of the _id index.
+// Every entry is below the root DSE, so a subtree from the empty DN adds nothing.
+void appendScope(const std::string& baseId, Ldap::Search::Request::Scope scope,
+        sub_document& doc) {
+    using Scope = Ldap::Search::Request::Scope;
+    switch(scope) {
+    case Scope::Base:
+        doc.append(kvp("_id", baseId));
+        break;
+    case Scope::One:
+        doc.append(kvp("_parent", baseId));
+        break;
+    case Scope::Sub:
+        if (baseId.empty())
+            break;
+        doc.append(kvp("$or", [&baseId](sub_array arr) {
+            arr.append([&baseId](sub_document baseDoc) {
+                baseDoc.append(kvp("_id", baseId));
+            });
+            arr.append([&baseId](sub_document childDoc) {
+                childDoc.append(kvp("_id", [&baseId](sub_document rangeDoc) {
+                    rangeDoc.append(kvp("$gte", baseId + ","));
+                    rangeDoc.append(kvp("$lt", baseId + "-"));
+                }));
+            });
+        }));
+        break;
+    }
+}
+
+// caseIgnoreMatch, near enough: ASCII letters are lower-cased, leading and trailing spaces
+// are dropped and runs of spaces count as one. Substring pieces keep their spaces at the
+// ends, since they're in the middle of a value.
+std::string normalizeValue(const std::string& value, bool trim = true) {
+    std::string ret;
+    ret.reserve(value.size());
+    bool space = false;
+    for (auto c: value) {
+        if (c == ' ') {
+            space = true;
+            continue;
+        }
+        if (space && (!trim || !ret.empty()))
+            ret.push_back(' ');
+        space = false;
+        ret.push_back((c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c);
+    }
+    if (space && !trim)
+        ret.push_back(' ');
+    return ret;
+}
+
+// Reverses a value a character at a time, leaving each UTF-8 sequence intact so the result
+// is still valid UTF-8.
+std::string reverseValue(const std::string& value) {
+    std::string ret;
+    ret.reserve(value.size());
+    auto end = value.size();
+    while (end > 0) {
+        auto start = end - 1;
+        while (start > 0 && (static_cast<uint8_t>(value[start]) & 0xc0) == 0x80)
+            start--;
+        ret.append(value, start, end - start);
+        end = start;
+    }
+    return ret;
+}
+
+std::string escapeRegex(const std::string& value) {
+    std::string ret;
+    for (auto c: value) {
+        if (c != '\0' && std::strchr("\\^$.|?*+()[]{}", c))
+            ret.push_back('\\');
+        ret.push_back(c);
+    }
+    return ret;
+}
+
+// Days since 1970-01-01 in the proleptic Gregorian calendar, and back again.
+int64_t daysFromCivil(int64_t year, unsigned month, unsigned day) {
+    year -= month <= 2;
+    const int64_t era = (year >= 0 ? year : year - 399) / 400;
+    const unsigned yearOfEra = static_cast<unsigned>(year - era * 400);
+    const unsigned dayOfYear = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+    const unsigned dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+    return era * 146097 + static_cast<int64_t>(dayOfEra) - 719468;
+}
+
+void civilFromDays(int64_t days, int64_t& year, unsigned& month, unsigned& day) {
+    days += 719468;
+    const int64_t era = (days >= 0 ? days : days - 146096) / 146097;
+    const unsigned dayOfEra = static_cast<unsigned>(days - era * 146097);
+    const unsigned yearOfEra =
+        (dayOfEra - dayOfEra / 1460 + dayOfEra / 36524 - dayOfEra / 146096) / 365;
+    const unsigned dayOfYear = dayOfEra - (365 * yearOfEra + yearOfEra / 4 - yearOfEra / 100);
+    const unsigned monthIndex = (5 * dayOfYear + 2) / 153;
+    day = dayOfYear - (153 * monthIndex + 2) / 5 + 1;
+    month = monthIndex < 10 ? monthIndex + 3 : monthIndex - 9;
+    year = static_cast<int64_t>(yearOfEra) + era * 400 + (month <= 2);
+}
+
+int64_t parseInteger(const std::string& value) {
+    size_t start = (!value.empty() && value[0] == '-') ? 1 : 0;
+    if (value.size() == start || value.find_first_not_of("0123456789", start) != std::string::npos)
+        throw std::invalid_argument("not an integer");
+    errno = 0;
+    auto ret = std::strtoll(value.c_str(), nullptr, 10);
+    if (errno == ERANGE)
+        throw std::invalid_argument("integer is out of range");
+    return ret;
+}
+
+// Milliseconds since the epoch for a GeneralizedTime (RFC 4517 3.3.13), which is
+// YYYYMMDDHH[MM[SS]][(.|,)fraction](Z|(+|-)HH[MM]), the fraction being of whichever unit
+// came last. Anything finer than a millisecond is dropped.
+int64_t parseGeneralizedTime(const std::string& value) {
+    const std::invalid_argument invalid("not a GeneralizedTime");
+    size_t pos = 0;
+    auto isDigit = [&]() {
+        return pos < value.size() && value[pos] >= '0' && value[pos] <= '9';
+    };
+    auto digits = [&](size_t count) {
+        int64_t ret = 0;
+        for (size_t i = 0; i < count; i++, pos++) {
+            if (!isDigit())
+                throw invalid;
+            ret = ret * 10 + (value[pos] - '0');
+        }
+        return ret;
+    };
+
+    auto year = digits(4);
+    auto month = static_cast<unsigned>(digits(2));
+    auto day = static_cast<unsigned>(digits(2));
+    auto hour = digits(2);
+    int64_t minute = 0, second = 0, unitMS = 3600 * 1000;
+    if (isDigit()) {
+        minute = digits(2);
+        unitMS = 60 * 1000;
+        if (isDigit()) {
+            second = digits(2);
+            unitMS = 1000;
+        }
+    }
+
+    int64_t fractionMS = 0;
+    if (pos < value.size() && (value[pos] == '.' || value[pos] == ',')) {
+        pos++;
+        if (!isDigit())
+            throw invalid;
+        int64_t numerator = 0, denominator = 1;
+        for (; isDigit(); pos++) {
+            if (denominator < 1000000000) {
+                numerator = numerator * 10 + (value[pos] - '0');
+                denominator *= 10;
+            }
+        }
+        fractionMS = unitMS * numerator / denominator;
+    }
+
+    if (pos >= value.size())
+        throw invalid;
+    int64_t offsetMS = 0;
+    auto zone = value[pos++];
+    if (zone == '+' || zone == '-') {
+        auto offsetHours = digits(2);
+        auto offsetMinutes = pos < value.size() ? digits(2) : 0;
+        if (offsetHours > 23 || offsetMinutes > 59)
+            throw invalid;
+        offsetMS = (offsetHours * 60 + offsetMinutes) * 60 * 1000 * (zone == '-' ? -1 : 1);
+    } else if (zone != 'Z') {
+        throw invalid;
+    }
+    if (pos != value.size())
+        throw invalid;
+
+    // Going back from the day count catches dates like February 30th.
+    auto days = daysFromCivil(year, month, day);
+    int64_t checkYear;
+    unsigned checkMonth, checkDay;
+    civilFromDays(days, checkYear, checkMonth, checkDay);
+    if (month < 1 || month > 12 || checkYear != year || checkMonth != month ||
+            checkDay != day || hour > 23 || minute > 59 || second > 60)
+        throw invalid;
+
+    return ((days * 24 + hour) * 60 + minute) * 60 * 1000 + second * 1000 + fractionMS -
+        offsetMS;
+}
+
+std::string formatGeneralizedTime(int64_t ms) {
+    const int64_t msPerDay = 24 * 3600 * 1000;
+    auto days = ms / msPerDay - (ms % msPerDay < 0 ? 1 : 0);
+    auto msOfDay = ms - days * msPerDay;
+    int64_t year;
+    unsigned month, day;
+    civilFromDays(days, year, month, day);
+
+    std::stringstream timeBuf;
+    timeBuf << std::setfill('0') << std::setw(4) << year << std::setw(2) << month
+        << std::setw(2) << day << std::setw(2) << msOfDay / 3600000
+        << std::setw(2) << msOfDay / 60000 % 60 << std::setw(2) << msOfDay / 1000 % 60;
+    auto fraction = msOfDay % 1000;
+    if (fraction != 0) {
+        timeBuf << "." << std::setw(3) << fraction;
+    }
+    auto ret = timeBuf.str();
+    if (fraction != 0) {
+        ret.erase(ret.find_last_not_of('0') + 1);
+    }
+    return ret + "Z";
+}
+
+bool parseBoolean(const std::string& value) {
+    if (boost::algorithm::iequals(value, "TRUE"))
+        return true;
+    if (boost::algorithm::iequals(value, "FALSE"))
+        return false;
+    throw std::invalid_argument("not a Boolean");
+}
+
+// Lower-cases the attribute type of each RDN and drops the spaces around it and around its
+// value, leaving the value and its escapes alone.
+std::string normalizeDN(const std::string& value) {
+    std::vector<std::string> rdns(1);
+    bool escaped = false;
+    for (auto c: value) {
+        if (!escaped && c == ',') {
+            rdns.emplace_back();
+            continue;
+        }
+        escaped = !escaped && c == '\\';
+        rdns.back().push_back(c);
+    }
+    if (rdns.size() == 1 && boost::algorithm::trim_copy(rdns[0]).empty())
+        return std::string{};
+
+    for (auto& rdn: rdns) {
+        auto eqPos = rdn.find('=');
+        if (eqPos == std::string::npos)
+            throw std::invalid_argument("not a DN");
+        auto type = boost::algorithm::trim_copy(rdn.substr(0, eqPos));
+        auto rdnValue = boost::algorithm::trim_left_copy(rdn.substr(eqPos + 1));
+        // An escaped space at the end is part of the value.
+        auto end = rdnValue.find_last_not_of(' ');
+        if (end != std::string::npos && end + 1 < rdnValue.size() && rdnValue[end] == '\\')
+            end++;
+        rdnValue.erase(end == std::string::npos ? 0 : end + 1);
+        if (type.empty() || rdnValue.empty())
+            throw std::invalid_argument("not a DN");
+        rdn = boost::algorithm::to_lower_copy(type) + "=" + rdnValue;
+    }
+    return boost::algorithm::join(rdns, ",");
+}
+
+std::string syntaxName(Syntax syntax) {
+    switch (syntax) {
+    case Syntax::Integer:
+        return "integer";
+    case Syntax::GeneralizedTime:
+        return "generalizedTime";
+    case Syntax::Boolean:
+        return "boolean";
+    case Syntax::DN:
+        return "dn";
+    }
+    return std::string{};
+}
+
+const Syntax* syntaxOf(const Schema& schema, const std::string& attribute) {
+    auto it = schema.find(boost::algorithm::to_lower_copy(attribute));
+    return it == schema.end() ? nullptr : &it->second;
+}
+
+// The schema an entry's values were typed with, so entries written before it last changed
+// can be found.
+std::string schemaList(const Schema& schema) {
+    std::vector<std::string> parts;
+    for (const auto& attr: schema) {
+        parts.push_back(attr.first + ":" + syntaxName(attr.second));
+    }
+    return boost::algorithm::join(parts, ",");
+}
+
+// Builders for appendTypedValue: values go on the end of an array, or into a field.
+struct ArrayAppend {
+    sub_array& arr;
+    template <typename T>
+    void operator()(const T& value) { arr.append(value); }
+};
+
+struct FieldAppend {
+    sub_document& doc;
+    const std::string& key;
+    template <typename T>
+    void operator()(const T& value) { doc.append(kvp(key, value)); }
+};
+
+struct IgnoreValue {
+    template <typename T>
+    void operator()(const T&) {}
+};
+
+// Appends a value as the BSON type its syntax is stored as, or as a string if it has none.
+// Throws std::invalid_argument if the value isn't valid for the syntax.
+template <typename Append>
+void appendTypedValue(Append append, const std::string& value, const Syntax* syntax) {
+    if (syntax == nullptr) {
+        append(value);
+        return;
+    }
+    switch (*syntax) {
+    case Syntax::Integer:
+        append(parseInteger(value));
+        break;
+    case Syntax::GeneralizedTime:
+        append(bsoncxx::types::b_date{std::chrono::milliseconds{parseGeneralizedTime(value)}});
+        break;
+    case Syntax::Boolean:
+        append(parseBoolean(value));
+        break;
+    case Syntax::DN:
+        append(normalizeDN(value));
+        break;
+    }
+}
+
+// The LDAP string for a stored value, whichever type its syntax gave it. Returns false for
+// types we never store.
+template <typename Element>
+bool valueToString(const Element& el, std::string& value) {
+    switch (el.type()) {
+    case bsoncxx::type::k_utf8:
+        value = std::string{ el.get_utf8().value };
+        return true;
+    case bsoncxx::type::k_int64:
+        value = std::to_string(el.get_int64().value);
+        return true;
+    case bsoncxx::type::k_int32:
+        value = std::to_string(el.get_int32().value);
+        return true;
+    case bsoncxx::type::k_date:
+        value = formatGeneralizedTime(el.get_date().value.count());
+        return true;
+    case bsoncxx::type::k_bool:
+        value = el.get_bool().value ? "TRUE" : "FALSE";
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Adds every attribute value in a stored document to entry.
+void readAttributes(const bsoncxx::document::view& doc, Ldap::Entry& entry) {
+    std::string value;
+    for (bsoncxx::document::element el: doc) {
+        std::string key{ el.key() };
+        if (isInternalField(key)) {
+            continue;
+        }
+
+        if (el.type() == bsoncxx::type::k_array) {
+            for (bsoncxx::array::element subEl: el.get_array().value) {
+                if (valueToString(subEl, value))
+                    entry.appendValue(key, value);
+            }
+        } else if (valueToString(el, value)) {
+            entry.appendValue(key, value);
+        }
+    }
+}
+
+// Calls fn with the bytes of a stored value, straight out of the document if it's a string
+// and through scratch if it's typed. Returns false for types we never store.
+template <typename Element, typename Fn>
+bool visitValue(const Element& el, std::string& scratch, Fn& fn) {
+    if (el.type() == bsoncxx::type::k_utf8) {
+        auto value = el.get_utf8().value;
+        fn(value.data(), value.size());
+        return true;
+    }
+    if (!valueToString(el, scratch))
+        return false;
+    fn(scratch.data(), scratch.size());
+    return true;
+}
+
+// Calls fn for each value of an attribute and returns how many there were.
+template <typename Fn>
+size_t forEachValue(const bsoncxx::document::element& el, std::string& scratch, Fn fn) {
+    size_t count = 0;
+    if (el.type() == bsoncxx::type::k_array) {
+        for (bsoncxx::array::element subEl: el.get_array().value) {
+            count += visitValue(subEl, scratch, fn) ? 1 : 0;
+        }
+    } else {
+        count += visitValue(el, scratch, fn) ? 1 : 0;
+    }
+    return count;
+}
+
+// Appends an attribute's values, a single value on its own and more than one as an array.
+// Throws std::invalid_argument if a value isn't valid for the attribute's syntax.
+void appendAttribute(const std::string& name, const std::vector<std::string>& values,
+        const Syntax* syntax, sub_document& doc) {
+    if (values.size() == 1) {
+        appendTypedValue(FieldAppend{doc, name}, values[0], syntax);
+        return;
+    }
+    // Check them all first so a bad one can't leave a half written array behind.
+    for (const auto& value: values) {
+        appendTypedValue(IgnoreValue{}, value, syntax);
+    }
+    doc.append(kvp(name, [&](sub_array arr) {
+        for (const auto& value: values) {
+            appendTypedValue(ArrayAppend{arr}, value, syntax);
+        }
+    }));
+}
+
+// The normalized attributes an entry's shadow fields were made for, so entries written
+// before the list last changed can be found.
+std::string normalizedList(const std::set<std::string>& normalized) {
+    return boost::algorithm::join(normalized, ",");
+}
+
+// Adds the _norm and _rev shadow fields for whichever of the attributes are normalized.
+void appendShadowFields(const std::map<std::string, std::vector<std::string>>& attributes,
+        const std::set<std::string>& normalized, sub_document& doc) {
+    if (normalized.empty())
+        return;
+
+    std::map<std::string, std::vector<std::string>> shadows;
+    for (const auto& attr: attributes) {
+        auto name = boost::algorithm::to_lower_copy(attr.first);
+        if (normalized.count(name) == 0)
+            continue;
+        auto& values = shadows[name];
+        for (const auto& value: attr.second) {
+            values.push_back(normalizeValue(value));
+        }
+    }
+
+    doc.append(kvp("_normAttrs", normalizedList(normalized)));
+    doc.append(kvp("_norm", [&shadows](sub_document normDoc) {
+        for (const auto& shadow: shadows) {
+            normDoc.append(kvp(shadow.first, [&shadow](sub_array values) {
+                for (const auto& value: shadow.second) {
+                    values.append(value);
+                }
+            }));
+        }
+    }));
+    doc.append(kvp("_rev", [&shadows](sub_document revDoc) {
+        for (const auto& shadow: shadows) {
+            revDoc.append(kvp(shadow.first, [&shadow](sub_array values) {
+                for (const auto& value: shadow.second) {
+                    values.append(reverseValue(value));
+                }
+            }));
+        }
+    }));
+}
+
+} // namespace
+
+ResultOptions::ResultOptions(const Ldap::Search::Request& req):
+    typesOnly{req.typesOnly},
+    allAttributes{req.attributes.empty()},
+    attributes{}
+{
+    for (const auto& attr: req.attributes) {
+        if (attr == "*") {
+            allAttributes = true;
+        } else if (attr != "1.1") {
+            attributes.insert(boost::algorithm::to_lower_copy(attr));
+        }
+    }
+}
+
+bool ResultOptions::wants(const std::string& attribute) const {
+    return allAttributes || attributes.count(boost::algorithm::to_lower_copy(attribute)) > 0;
+}
+
 MongoCursor::iterator& MongoCursor::iterator::operator++() {
     ++_cursorIt;
     return *this;
 }
 
-void MongoCursor::iterator::refreshDocument() {
-    bsoncxx::document::view resultDoc;
+std::string MongoCursor::iterator::id() {
+    try {
+        return std::string{ (*_cursorIt)["_id"].get_utf8().value };
+    } catch (const mongocxx::exception& e) {
+        LOG_S(ERROR) << "Error fetching next document: " << e.what();
+        throw Ldap::Exception(Ldap::ErrorCode::operationsError);
+    }
+}
+
+bsoncxx::document::view MongoCursor::iterator::currentDocument() {
     try {
-        resultDoc = *_cursorIt;
+        return *_cursorIt;
     } catch (const mongocxx::exception& e) {
         LOG_S(ERROR) << "Error fetching next document: " << e.what();
         throw Ldap::Exception(Ldap::ErrorCode::operationsError);
     }
+}
+
+void MongoCursor::iterator::refreshDocument() {
+    auto resultDoc = currentDocument();
     std::string dn{ resultDoc["_id"].get_utf8().value };
     dn = dnPartsToId(dnToList(dn));
     curEntry = Ldap::Entry { dn };
+    readAttributes(resultDoc, curEntry);
+}
 
+// Every length in BER comes before what it measures, so the document is walked twice: once
+// to size each attribute's values and once to write them.
+void MongoCursor::iterator::encodeResult(uint64_t messageId, const ResultOptions& options,
+        Ber::ByteVector& out) {
+    using Ber::encodedLength;
+    auto resultDoc = currentDocument();
+    auto dn = dnPartsToId(dnToList(std::string{ resultDoc["_id"].get_utf8().value }));
+    auto returned = [&options](const std::string& key) {
+        return !isInternalField(key) && options.wants(key);
+    };
+
+    std::string scratch;
+    // The content length of each returned attribute's value set, or noValues for one that
+    // turns out to have no values and is left out after all.
+    const auto noValues = std::numeric_limits<size_t>::max();
+    std::vector<size_t> setLengths;
+    size_t attrsLength = 0;
     for (bsoncxx::document::element el: resultDoc) {
-        // We've already parsed the _id above
         std::string key{ el.key() };
-        if (key == "_id") {
+        if (!returned(key))
             continue;
-        }
+        size_t setLength = 0;
+        auto count = forEachValue(el, scratch, [&](const char*, size_t size) {
+            setLength += encodedLength(size);
+        });
+        if (options.typesOnly)
+            setLength = 0;
+        setLengths.push_back(count == 0 ? noValues : setLength);
+        if (count > 0)
+            attrsLength += encodedLength(encodedLength(key.size()) + encodedLength(setLength));
+    }
 
-        switch(el.type()) {
-            case bsoncxx::type::k_utf8:
-                curEntry.appendValue(key, std::string{ el.get_utf8().value });
-                break;
-            case bsoncxx::type::k_array: {
-                bsoncxx::array::view values{el.get_array().value};
-                for (bsoncxx::array::element subEl: values) {
-                    curEntry.appendValue(key, std::string { subEl.get_utf8().value });
-                }
-                                         }
-                break;
-            default:
-                break;
-        }
+    Ber::ByteVector id;
+    Ber::encodeInteger(static_cast<int64_t>(messageId), id);
+    auto opLength = encodedLength(dn.size()) + encodedLength(attrsLength);
+    auto messageLength = encodedLength(id.size()) + encodedLength(opLength);
+    // out may be a batch of results, so grow it geometrically rather than to fit.
+    auto needed = out.size() + encodedLength(messageLength);
+    if (needed > out.capacity())
+        out.reserve(std::max(needed, out.capacity() * 2));
+
+    Ber::appendHeader(Ber::Type::Constructed, Ber::Class::Universal,
+        static_cast<uint8_t>(Ber::Tag::Sequence), messageLength, out);
+    Ber::appendHeader(Ber::Type::Primative, Ber::Class::Universal,
+        static_cast<uint8_t>(Ber::Tag::Integer), id.size(), out);
+    out.insert(out.end(), id.begin(), id.end());
+    Ber::appendHeader(Ber::Type::Constructed, Ber::Class::Application,
+        static_cast<uint8_t>(Ldap::MessageTag::SearchResEntry), opLength, out);
+    Ber::appendHeader(Ber::Type::Primative, Ber::Class::Universal,
+        static_cast<uint8_t>(Ber::Tag::OctetString), dn.size(), out);
+    out.insert(out.end(), dn.begin(), dn.end());
+    Ber::appendHeader(Ber::Type::Constructed, Ber::Class::Universal,
+        static_cast<uint8_t>(Ber::Tag::Sequence), attrsLength, out);
+
+    size_t attr = 0;
+    for (bsoncxx::document::element el: resultDoc) {
+        std::string key{ el.key() };
+        if (!returned(key))
+            continue;
+        auto setLength = setLengths[attr++];
+        if (setLength == noValues)
+            continue;
+        Ber::appendHeader(Ber::Type::Constructed, Ber::Class::Universal,
+            static_cast<uint8_t>(Ber::Tag::Sequence),
+            encodedLength(key.size()) + encodedLength(setLength), out);
+        Ber::appendHeader(Ber::Type::Primative, Ber::Class::Universal,
+            static_cast<uint8_t>(Ber::Tag::OctetString), key.size(), out);
+        out.insert(out.end(), key.begin(), key.end());
+        Ber::appendHeader(Ber::Type::Constructed, Ber::Class::Universal,
+            static_cast<uint8_t>(Ber::Tag::Set), setLength, out);
+        if (options.typesOnly)
+            continue;
+        forEachValue(el, scratch, [&](const char* data, size_t size) {
+            Ber::appendHeader(Ber::Type::Primative, Ber::Class::Universal,
+                static_cast<uint8_t>(Ber::Tag::OctetString), size, out);
+            out.insert(out.end(), data, data + size);
+        });
     }
 }
 
@@ -128,35 +768,212 @@ MongoBackend::MongoBackend(
     std::string connectURI,
     std::string db,
     std::string collection,
-    std::string rootDN
+    std::string rootDN,
+    PoolOptions poolOptions,
+    size_t entryCacheBytes,
+    std::set<std::string> normalizedAttributes,
+    Schema schema
 ) :
-    _client { mongocxx::uri { connectURI } },
-    _collection { _client[db][collection] },
-    _rootdn { rootDN }
+    // Make sure the driver is initialized before the pool gets constructed
+    _pool { (driverInstance(), mongocxx::uri { poolURI(connectURI, poolOptions) }) },
+    _db { db },
+    _collection { collection },
+    _rootdn { rootDN },
+    _cache { entryCacheBytes },
+    _normalized { std::move(normalizedAttributes) },
+    _schema { std::move(schema) }
 {}
 
+mongocxx::pool::entry MongoBackend::acquireClient() {
+    auto client = _pool.try_acquire();
+    if (!client) {
+        // Only operation threads get here, so waiting doesn't hold up anyone's socket.
+        poolWaits.add();
+        try {
+            client = _pool.acquire();
+        } catch (const mongocxx::exception& e) {
+            poolTimeouts.add();
+            LOG_S(ERROR) << "Timed out waiting for a mongo client: " << e.what();
+            throw Ldap::Exception(Ldap::ErrorCode::busy);
+        }
+    }
+
+    poolAcquired.add();
+    poolInUse.add();
+    poolPeakInUse.max(poolInUse.value());
+    // Wrap the pool's deleter so we know when the client goes back to the pool.
+    auto poolDeleter = client->get_deleter();
+    return mongocxx::pool::entry(client->release(), [poolDeleter](mongocxx::client* c) {
+        poolInUse.sub();
+        poolDeleter(c);
+    });
+}
+
+mongocxx::collection MongoBackend::collection(mongocxx::pool::entry& client) {
+    return (*client)[_db][_collection];
+}
+
+void MongoBackend::prepareCollection() {
+    try {
+        auto client = acquireClient();
+        auto coll = collection(client);
+
+        auto parentIndex = document{};
+        parentIndex.append(kvp("_parent", 1));
+        parentIndex.append(kvp("_id", 1));
+        coll.create_index(parentIndex.view());
+
+        auto missingDoc = document{};
+        missingDoc.append(kvp("_parent", [](sub_document existsDoc) {
+            existsDoc.append(kvp("$exists", false));
+        }));
+        auto projection = document{};
+        projection.append(kvp("_id", 1));
+        mongocxx::options::find opts;
+        opts.projection(projection.extract());
+
+        size_t backfilled = 0;
+        for (auto&& doc: coll.find(missingDoc.view(), opts)) {
+            std::string dnId{ doc["_id"].get_utf8().value };
+            auto idParts = dnToList(dnId);
+            std::list<std::string> dnParts(idParts.rbegin(), idParts.rend());
+
+            auto filterDoc = document{};
+            filterDoc.append(kvp("_id", dnId));
+            auto updateDoc = document{};
+            updateDoc.append(kvp("$set", [&dnParts](sub_document setDoc) {
+                appendTreeFields(dnParts, setDoc);
+            }));
+            coll.update_one(filterDoc.view(), updateDoc.view());
+            backfilled++;
+        }
+        if (backfilled > 0) {
+            LOG_S(INFO) << "Added tree fields to " << backfilled << " existing entries";
+        }
+
+        prepareShadowFields(coll);
+        prepareTypedFields(coll);
+    } catch (const mongocxx::exception& e) {
+        LOG_S(ERROR) << "Error preparing collection " << _collection << ": " << e.what();
+        throw Ldap::Exception(Ldap::ErrorCode::operationsError, e.what());
+    }
+}
+
+void MongoBackend::prepareShadowFields(mongocxx::collection& coll) {
+    if (_normalized.empty())
+        return;
+
+    // Entries written before the list of normalized attributes last changed have shadow
+    // fields for the wrong attributes, or none at all.
+    auto missingDoc = document{};
+    missingDoc.append(kvp("_normAttrs", [this](sub_document neDoc) {
+        neDoc.append(kvp("$ne", normalizedList(_normalized)));
+    }));
+
+    for (const auto& name: _normalized) {
+        auto normIndex = document{};
+        normIndex.append(kvp("_norm." + name, 1));
+        coll.create_index(normIndex.view());
+        auto revIndex = document{};
+        revIndex.append(kvp("_rev." + name, 1));
+        coll.create_index(revIndex.view());
+    }
+
+    size_t backfilled = 0;
+    for (auto&& doc: coll.find(missingDoc.view())) {
+        Ldap::Entry entry;
+        readAttributes(doc, entry);
+
+        auto filterDoc = document{};
+        filterDoc.append(kvp("_id", doc["_id"].get_utf8().value));
+        auto updateDoc = document{};
+        updateDoc.append(kvp("$set", [&](sub_document setDoc) {
+            appendShadowFields(entry.attributes, _normalized, setDoc);
+        }));
+        coll.update_one(filterDoc.view(), updateDoc.view());
+        backfilled++;
+    }
+    if (backfilled > 0) {
+        LOG_S(INFO) << "Added shadow fields to " << backfilled << " existing entries";
+    }
+}
+
+void MongoBackend::prepareTypedFields(mongocxx::collection& coll) {
+    for (const auto& attr: _schema) {
+        auto index = document{};
+        index.append(kvp(attr.first, 1));
+        coll.create_index(index.view());
+    }
+
+    // Entries written under a different schema, or before there was one, may have values
+    // stored as the wrong type. With no schema, only entries that were typed need fixing.
+    auto list = schemaList(_schema);
+    auto staleDoc = document{};
+    staleDoc.append(kvp("_schema", [&](sub_document staleSchema) {
+        if (_schema.empty())
+            staleSchema.append(kvp("$exists", true));
+        else
+            staleSchema.append(kvp("$ne", list));
+    }));
+
+    size_t backfilled = 0;
+    for (auto&& doc: coll.find(staleDoc.view())) {
+        Ldap::Entry entry;
+        readAttributes(doc, entry);
+        std::string dnId{ doc["_id"].get_utf8().value };
+
+        auto filterDoc = document{};
+        filterDoc.append(kvp("_id", dnId));
+        auto updateDoc = document{};
+        updateDoc.append(kvp("$set", [&](sub_document setDoc) {
+            for (const auto& values: entry.attributes) {
+                auto syntax = syntaxOf(_schema, values.first);
+                try {
+                    appendAttribute(values.first, values.second, syntax, setDoc);
+                } catch (const std::invalid_argument& e) {
+                    // Leave it a string rather than lose it. It won't match typed filters
+                    // until it's fixed.
+                    LOG_S(WARNING) << "Not retyping " << values.first << " of " << dnId
+                        << " as " << syntaxName(*syntax) << ": " << e.what();
+                    appendAttribute(values.first, values.second, nullptr, setDoc);
+                }
+            }
+            setDoc.append(kvp("_schema", list));
+        }));
+        coll.update_one(filterDoc.view(), updateDoc.view());
+        backfilled++;
+    }
+    if (backfilled > 0) {
+        LOG_S(INFO) << "Retyped attributes of " << backfilled << " existing entries";
+    }
+}
+
 void MongoBackend::saveEntry(Ldap::Entry e, bool insert) {
-    std::string dnId = dnPartsToId(dnToList(e.dn));
+    auto dnParts = dnToList(e.dn);
+    std::string dnId = dnPartsToId(dnParts);
 
     auto updateDoc = document{};
     updateDoc.append(kvp("_id", dnId));
+    appendTreeFields(dnParts, updateDoc);
+    appendShadowFields(e.attributes, _normalized, updateDoc);
+    if (!_schema.empty()) {
+        updateDoc.append(kvp("_schema", schemaList(_schema)));
+    }
 
     for (auto && attr: e.attributes) {
-        auto values = attr.second;
-        if (values.size() > 1) {
-            updateDoc.append(kvp(attr.first, [values](sub_array subArray) {
-                for(auto && v: values) {
-                    subArray.append(v);
-                }
-            }));
-        } else {
-            updateDoc.append(kvp(attr.first, values[0]));
+        try {
+            appendAttribute(attr.first, attr.second, syntaxOf(_schema, attr.first), updateDoc);
+        } catch (const std::invalid_argument& err) {
+            throw Ldap::Exception(Ldap::ErrorCode::invalidAttributeSyntax,
+                (attr.first + ": " + err.what()).c_str());
         }
     }
 
     try {
+        auto client = acquireClient();
+        auto coll = collection(client);
         if (insert) {
-            _collection.insert_one(updateDoc.view());
+            coll.insert_one(updateDoc.view());
         } else {
             auto opts = mongocxx::options::update();
             opts.upsert(true);
@@ -164,112 +981,533 @@ void MongoBackend::saveEntry(Ldap::Entry e, bool insert) {
             auto filterDoc = document{};
             filterDoc.append(kvp("_id", dnId));
 
-            _collection.replace_one(filterDoc.view(), updateDoc.view(), opts);
+            coll.replace_one(filterDoc.view(), updateDoc.view(), opts);
         }
+        _cache.invalidate(dnId);
     } catch (const mongocxx::exception) {
+        // The write may have gone through even though we got an error.
+        _cache.invalidate(dnId);
         LOG_S(ERROR) << "Error " << (insert ? "inserting" : "updating") << " document for "
             << "dn " << e.dn;
         throw Ldap::Exception(Ldap::ErrorCode::operationsError);
     }
 }
 
+namespace {
+
+// An attribute's values as an array inside an aggregation expression, whether it's stored
+// as an array, as a single value or not at all.
+void appendValuesArray(const std::string& name, sub_document& expr) {
+    const auto path = "$" + name;
+    expr.append(kvp("$cond", [&](sub_array isArray) {
+        isArray.append([&](sub_document test) {
+            test.append(kvp("$isArray", path));
+        });
+        isArray.append(path);
+        isArray.append([&](sub_document notArray) {
+            notArray.append(kvp("$cond", [&](sub_array isMissing) {
+                isMissing.append([&](sub_document test) {
+                    test.append(kvp("$eq", [&](sub_array operands) {
+                        operands.append([&](sub_document type) {
+                            type.append(kvp("$type", path));
+                        });
+                        operands.append("missing");
+                    }));
+                });
+                isMissing.append([](sub_array) {});
+                isMissing.append([&](sub_array single) {
+                    single.append(path);
+                });
+            }));
+        });
+    }));
+}
+
+// Values from the request go in as a literal, so one like "$cn" isn't taken for a field.
+void appendLiteralValues(const Memory::ArenaVector<std::string>& values, const Syntax* syntax,
+        sub_document& expr) {
+    expr.append(kvp("$literal", [&](sub_array arr) {
+        for (const auto& value: values) {
+            appendTypedValue(ArrayAppend{arr}, value, syntax);
+        }
+    }));
+}
+
+// One modification as an $addFields stage, which sees the entry as the stages before it
+// left it. Attributes it touches always come out as arrays, and are removed once empty.
+// modifyEntry's filter has already made sure every added value is new and every deleted one
+// is there, so values keep their order: adds go on the end and deletes leave the rest as
+// they were.
+void appendModifyStage(const Ldap::Modify::Modification& mod, const Syntax* syntax,
+        sub_document& stage) {
+    using ModType = Ldap::Modify::Modification::Type;
+    if (mod.values.empty() && mod.type != ModType::Add) {
+        stage.append(kvp(mod.name, "$$REMOVE"));
+        return;
+    }
+
+    stage.append(kvp(mod.name, [&](sub_document expr) {
+        switch (mod.type) {
+        case ModType::Add:
+            expr.append(kvp("$concatArrays", [&](sub_array arrays) {
+                arrays.append([&](sub_document current) {
+                    appendValuesArray(mod.name, current);
+                });
+                arrays.append([&](sub_document added) {
+                    appendLiteralValues(mod.values, syntax, added);
+                });
+            }));
+            break;
+        case ModType::Replace:
+            appendLiteralValues(mod.values, syntax, expr);
+            break;
+        case ModType::Delete:
+            expr.append(kvp("$let", [&](sub_document let) {
+                let.append(kvp("vars", [&](sub_document vars) {
+                    vars.append(kvp("left", [&](sub_document left) {
+                        left.append(kvp("$filter", [&](sub_document filter) {
+                            filter.append(kvp("input", [&](sub_document current) {
+                                appendValuesArray(mod.name, current);
+                            }));
+                            filter.append(kvp("cond", [&](sub_document cond) {
+                                cond.append(kvp("$not", [&](sub_array notIn) {
+                                    notIn.append([&](sub_document in) {
+                                        in.append(kvp("$in", [&](sub_array operands) {
+                                            operands.append("$$this");
+                                            operands.append([&](sub_document deleted) {
+                                                appendLiteralValues(mod.values, syntax,
+                                                    deleted);
+                                            });
+                                        }));
+                                    });
+                                }));
+                            }));
+                        }));
+                    }));
+                }));
+                let.append(kvp("in", [](sub_document in) {
+                    in.append(kvp("$cond", [](sub_array isEmpty) {
+                        isEmpty.append([](sub_document test) {
+                            test.append(kvp("$eq", [](sub_array operands) {
+                                operands.append([](sub_document size) {
+                                    size.append(kvp("$size", "$$left"));
+                                });
+                                operands.append(0);
+                            }));
+                        });
+                        isEmpty.append("$$REMOVE");
+                        isEmpty.append("$$left");
+                    }));
+                }));
+            }));
+            break;
+        }
+    }));
+}
+
+// What the modifications so far have done to an attribute, so a later add or delete can be
+// checked against them rather than what's stored.
+struct ModifiedAttribute {
+    // Set once a replace or a delete means present is every value the attribute has.
+    bool exact = false;
+    std::set<std::string> present;
+    std::set<std::string> absent;
+};
+
+// Options for a find that only needs to know whether anything matched.
+mongocxx::options::find idOnly() {
+    auto projection = document{};
+    projection.append(kvp("_id", 1));
+    mongocxx::options::find opts;
+    opts.projection(projection.extract());
+    return opts;
+}
+
+// What has to be stored for the deletes to succeed, and what mustn't be for the adds to.
+struct ModifyPrecondition {
+    bool exists = false;
+    std::vector<std::string> values;
+    std::vector<std::string> newValues;
+};
+
+} // namespace
+
+void MongoBackend::modifyEntry(const std::string& dn,
+        const Memory::ArenaVector<Ldap::Modify::Modification>& mods) {
+    using ModType = Ldap::Modify::Modification::Type;
+    auto dnId = dnPartsToId(dnToList(dn));
+
+    std::map<std::string, ModifiedAttribute> modified;
+    std::map<std::string, ModifyPrecondition> preconditions;
+    std::set<std::string> shadowed;
+    bool missingValue = false;
+    bool valueExists = false;
+    for (const auto& mod: mods) {
+        for (const auto& value: mod.values) {
+            try {
+                appendTypedValue(IgnoreValue{}, value, syntaxOf(_schema, mod.name));
+            } catch (const std::invalid_argument& err) {
+                throw Ldap::Exception(Ldap::ErrorCode::invalidAttributeSyntax,
+                    (mod.name + ": " + err.what()).c_str());
+            }
+        }
+        if (_normalized.count(boost::algorithm::to_lower_copy(mod.name)) > 0)
+            shadowed.insert(mod.name);
+
+        auto touched = modified.count(mod.name) > 0;
+        auto& state = modified[mod.name];
+        switch (mod.type) {
+        case ModType::Add:
+            for (const auto& value: mod.values) {
+                if (state.present.count(value) > 0)
+                    valueExists = true;
+                else if (!state.exact && state.absent.count(value) == 0)
+                    preconditions[mod.name].newValues.push_back(value);
+                state.present.insert(value);
+                state.absent.erase(value);
+            }
+            break;
+        case ModType::Delete:
+            if (mod.values.empty()) {
+                if (state.exact && state.present.empty())
+                    missingValue = true;
+                else if (!touched || state.present.empty())
+                    preconditions[mod.name].exists = true;
+                state = ModifiedAttribute{};
+                state.exact = true;
+                break;
+            }
+            for (const auto& value: mod.values) {
+                if (state.present.count(value) == 0) {
+                    if (state.exact || state.absent.count(value) > 0)
+                        missingValue = true;
+                    else
+                        preconditions[mod.name].values.push_back(value);
+                }
+                state.present.erase(value);
+                state.absent.insert(value);
+            }
+            break;
+        case ModType::Replace:
+            state = ModifiedAttribute{};
+            state.exact = true;
+            state.present.insert(mod.values.begin(), mod.values.end());
+            if (state.present.size() != mod.values.size())
+                valueExists = true;
+            break;
+        }
+    }
+
+    // The deletes' values must all be there and the adds' values mustn't, or the filter won't
+    // match and nothing changes. newFilter only checks the adds, to tell which it was.
+    auto filterDoc = document{};
+    filterDoc.append(kvp("_id", dnId));
+    auto newFilter = document{};
+    newFilter.append(kvp("_id", dnId));
+    bool checkNew = false;
+    for (const auto& precondition: preconditions) {
+        auto syntax = syntaxOf(_schema, precondition.first);
+        auto appendNew = [&](sub_document test) {
+            test.append(kvp("$nin", [&](sub_array values) {
+                for (const auto& value: precondition.second.newValues) {
+                    appendTypedValue(ArrayAppend{values}, value, syntax);
+                }
+            }));
+        };
+        filterDoc.append(kvp(precondition.first, [&](sub_document test) {
+            if (precondition.second.exists)
+                test.append(kvp("$exists", true));
+            if (!precondition.second.values.empty()) {
+                test.append(kvp("$all", [&](sub_array values) {
+                    for (const auto& value: precondition.second.values) {
+                        appendTypedValue(ArrayAppend{values}, value, syntax);
+                    }
+                }));
+            }
+            if (!precondition.second.newValues.empty())
+                appendNew(test);
+        }));
+        if (!precondition.second.newValues.empty()) {
+            newFilter.append(kvp(precondition.first, appendNew));
+            checkNew = true;
+        }
+    }
+
+    mongocxx::pipeline update;
+    for (const auto& mod: mods) {
+        auto stage = document{};
+        appendModifyStage(mod, syntaxOf(_schema, mod.name), stage);
+        update.add_fields(stage.view());
+    }
+
+    auto projection = document{};
+    projection.append(kvp("_id", 1));
+    for (const auto& name: shadowed) {
+        projection.append(kvp(name, 1));
+    }
+    mongocxx::options::find_one_and_update opts;
+    opts.return_document(mongocxx::options::return_document::k_after);
+    opts.projection(projection.extract());
+
+    try {
+        auto client = acquireClient();
+        auto coll = collection(client);
+        if (missingValue)
+            throwModifyError(coll, dnId, Ldap::ErrorCode::noSuchAttribute);
+        if (valueExists)
+            throwModifyError(coll, dnId, Ldap::ErrorCode::attributeOrValueExists);
+        auto result = coll.find_one_and_update(filterDoc.view(), update, opts);
+        _cache.invalidate(dnId);
+        if (!result) {
+            auto code = Ldap::ErrorCode::noSuchAttribute;
+            if (checkNew && !coll.find_one(newFilter.view(), idOnly()))
+                code = Ldap::ErrorCode::attributeOrValueExists;
+            throwModifyError(coll, dnId, code);
+        }
+        if (shadowed.empty())
+            return;
+
+        // Shadow fields can't be worked out inside the update, so they're set from what it
+        // left behind. If another modify has changed the attributes since, this matches
+        // nothing and that modify's own update of the shadow fields wins.
+        Ldap::Entry entry;
+        readAttributes(result->view(), entry);
+        auto shadowFilter = document{};
+        shadowFilter.append(kvp("_id", dnId));
+        auto setDoc = document{};
+        auto unsetDoc = document{};
+        bool setAny = false, unsetAny = false;
+        for (const auto& name: shadowed) {
+            auto lowerName = boost::algorithm::to_lower_copy(name);
+            auto stored = result->view()[name];
+            if (!stored) {
+                shadowFilter.append(kvp(name, [](sub_document missing) {
+                    missing.append(kvp("$exists", false));
+                }));
+                unsetDoc.append(kvp("_norm." + lowerName, ""));
+                unsetDoc.append(kvp("_rev." + lowerName, ""));
+                unsetAny = true;
+                continue;
+            }
+            shadowFilter.append(kvp(name, stored.get_value()));
+            const auto& values = entry.attributes[name];
+            setDoc.append(kvp("_norm." + lowerName, [&values](sub_array norm) {
+                for (const auto& value: values) {
+                    norm.append(normalizeValue(value));
+                }
+            }));
+            setDoc.append(kvp("_rev." + lowerName, [&values](sub_array rev) {
+                for (const auto& value: values) {
+                    rev.append(reverseValue(normalizeValue(value)));
+                }
+            }));
+            setAny = true;
+        }
+        auto shadowUpdate = document{};
+        if (setAny)
+            shadowUpdate.append(kvp("$set", setDoc.view()));
+        if (unsetAny)
+            shadowUpdate.append(kvp("$unset", unsetDoc.view()));
+        coll.update_one(shadowFilter.view(), shadowUpdate.view());
+    } catch (const mongocxx::exception& e) {
+        // The update may have gone through even though we got an error.
+        _cache.invalidate(dnId);
+        LOG_S(ERROR) << "Error modifying " << dn << ": " << e.what();
+        throw Ldap::Exception(Ldap::ErrorCode::operationsError, e.what());
+    }
+}
+
+void MongoBackend::throwModifyError(mongocxx::collection& coll, const std::string& dnId,
+        Ldap::ErrorCode code) {
+    auto searchDoc = document{};
+    searchDoc.append(kvp("_id", dnId));
+    if (!coll.find_one(searchDoc.view(), idOnly()))
+        throw Ldap::Exception(Ldap::ErrorCode::noSuchObject);
+    throw Ldap::Exception(code);
+}
+
 std::unique_ptr<Ldap::Entry> MongoBackend::findEntry(std::string dn) {
+    auto dnId = dnPartsToId(dnToList(dn));
+    uint64_t generation = 0;
+    auto cached = _cache.find(dnId, generation);
+    if (cached) {
+        auto e = std::unique_ptr<Ldap::Entry>{new Ldap::Entry{*cached}};
+        e->dn = dn;
+        return e;
+    }
+
     auto e = std::unique_ptr<Ldap::Entry>{new Ldap::Entry{dn}};
     auto searchDoc = document{};
-    searchDoc.append(kvp("_id", dnPartsToId(dnToList(dn))));
+    searchDoc.append(kvp("_id", dnId));
     mongocxx::stdx::optional<bsoncxx::document::value> resultDoc;
     try {
-        resultDoc = _collection.find_one(searchDoc.view());
+        auto client = acquireClient();
+        resultDoc = collection(client).find_one(searchDoc.view());
     } catch (const mongocxx::exception& e) {
         LOG_S(ERROR) << "Error finding " << dn << ": " << e.what();
         throw Ldap::Exception(Ldap::ErrorCode::operationsError);
     }
     if (!resultDoc)
         throw Ldap::Exception(Ldap::ErrorCode::noSuchObject);
+    readAttributes(resultDoc->view(), *e);
 
-    for (bsoncxx::document::element el: resultDoc->view()) {
-        // We've already parsed the _id above
-        std::string key{ el.key() };
-        if (key == "_id") {
-            continue;
+    _cache.insert(dnId, std::make_shared<Ldap::Entry>(*e), generation);
+    return e;
+}
+
+namespace {
+
+// Builds the regex for a substring filter. On a normalized attribute it's always anchored at
+// the start, going against the reversed shadow field if only the end is known, so mongo can
+// turn the anchored part into index bounds and only run the rest of the regex on what's in
+// them.
+void appendSubstringFilter(const Ldap::Search::Filter& filter, bool normalized,
+        sub_document& searchDoc) {
+    using SubType = Ldap::Search::SubFilter::Type;
+    bool hasInitial = false, hasFinal = false;
+    std::string initial, final;
+    std::vector<std::string> any;
+    for (auto && c: filter.subChildren) {
+        auto value = normalized ? normalizeValue(c.value, false) : c.value;
+        switch(c.type) {
+        case SubType::Initial:
+            hasInitial = true;
+            initial = normalized ? boost::algorithm::trim_left_copy(value) : value;
+            break;
+        case SubType::Any:
+            any.push_back(value);
+            break;
+        case SubType::Final:
+            hasFinal = true;
+            final = normalized ? boost::algorithm::trim_right_copy(value) : value;
+            break;
         }
+    }
 
-        switch(el.type()) {
-            case bsoncxx::type::k_utf8:
-                e->appendValue(key, std::string{ el.get_utf8().value });
-                break;
-            case bsoncxx::type::k_array: {
-                bsoncxx::array::view values{el.get_array().value};
-                for (bsoncxx::array::element subEl: values) {
-                    e->appendValue(key, std::string { subEl.get_utf8().value });
-                }
-                                         }
-                break;
-            default:
-                break;
+    auto name = boost::algorithm::to_lower_copy(filter.attributeName);
+    std::string field = normalized ? "_norm." + name : filter.attributeName;
+    std::stringstream pattern;
+    if (normalized && !hasInitial && hasFinal) {
+        field = "_rev." + name;
+        pattern << "^" << escapeRegex(reverseValue(final));
+        for (auto it = any.rbegin(); it != any.rend(); ++it) {
+            pattern << ".*" << escapeRegex(reverseValue(*it));
+        }
+    } else {
+        if (hasInitial)
+            pattern << "^" << escapeRegex(initial);
+        for (auto && value: any) {
+            if (pattern.tellp() > 0)
+                pattern << ".*";
+            pattern << escapeRegex(value);
+        }
+        if (hasFinal) {
+            if (pattern.tellp() > 0)
+                pattern << ".*";
+            pattern << escapeRegex(final) << "$";
         }
     }
+    searchDoc.append(kvp(field, bsoncxx::types::b_regex{ pattern.str(), "" }));
+}
 
-    return e;
+// Every document has an _id, so this matches nothing.
+void appendNoMatch(sub_document& searchDoc) {
+    searchDoc.append(kvp("_id", [](sub_document existsDoc) {
+        existsDoc.append(kvp("$exists", false));
+    }));
 }
 
-void processFilter(Ldap::Search::Filter filter, sub_document & searchDoc) {
+// Equality and ordering filters on a typed attribute compare typed values, so
+// (uidNumber>=5000) is numeric and can use the attribute's index. An assertion value that
+// isn't valid for the syntax makes the filter Undefined, which matches nothing.
+void appendTypedComparison(const Ldap::Search::Filter& filter, const Syntax* syntax,
+        sub_document& searchDoc) {
     using Type = Ldap::Search::Filter::Type;
+    try {
+        appendTypedValue(IgnoreValue{}, filter.value, syntax);
+    } catch (const std::invalid_argument&) {
+        appendNoMatch(searchDoc);
+        return;
+    }
+
+    if (filter.type == Type::Eq) {
+        appendTypedValue(FieldAppend{searchDoc, filter.attributeName}, filter.value, syntax);
+        return;
+    }
+    const std::string op = filter.type == Type::Gte ? "$gte" : "$lte";
+    searchDoc.append(kvp(filter.attributeName, [&](sub_document opDoc) {
+        appendTypedValue(FieldAppend{opDoc, op}, filter.value, syntax);
+    }));
+}
+
+} // namespace
+
+void processFilter(const Ldap::Search::Filter& filter, const std::set<std::string>& normalized,
+        const Schema& schema, sub_document & searchDoc) {
+    using Type = Ldap::Search::Filter::Type;
+    // Typed attributes compare typed values, and comparisons on normalized attributes go
+    // against the shadow field instead.
+    auto syntax = syntaxOf(schema, filter.attributeName);
+    auto isNormalized = syntax == nullptr && normalized.count(
+        boost::algorithm::to_lower_copy(filter.attributeName)) > 0;
+    auto field = isNormalized ?
+        "_norm." + boost::algorithm::to_lower_copy(filter.attributeName) : filter.attributeName;
+    auto value = isNormalized ? normalizeValue(filter.value) : filter.value;
     switch (filter.type) {
         case Type::And:
-            searchDoc.append(kvp("$and", [filter](sub_array arr) {
+            searchDoc.append(kvp("$and", [&filter, &normalized, &schema](sub_array arr) {
                 for (auto && c: filter.children) {
-                    arr.append([c](sub_document subDoc) {
-                        processFilter(c, subDoc);
+                    arr.append([&c, &normalized, &schema](sub_document subDoc) {
+                        processFilter(c, normalized, schema, subDoc);
                     });
                 }
             }));
             break;
         case Type::Or:
-            searchDoc.append(kvp("$or", [filter](sub_array arr) {
+            searchDoc.append(kvp("$or", [&filter, &normalized, &schema](sub_array arr) {
                 for (auto && c: filter.children) {
-                    arr.append([c](sub_document subDoc) {
-                        processFilter(c, subDoc);
+                    arr.append([&c, &normalized, &schema](sub_document subDoc) {
+                        processFilter(c, normalized, schema, subDoc);
                     });
                 }
             }));
             break;
         case Type::Not:
-            searchDoc.append(kvp("$not", [filter](sub_document subDoc) {
-                processFilter(filter.children[0], subDoc);
+            searchDoc.append(kvp("$not", [&filter, &normalized, &schema](sub_document subDoc) {
+                processFilter(filter.children[0], normalized, schema, subDoc);
                 }));
             break;
         case Type::Eq:
-            searchDoc.append(kvp(filter.attributeName, filter.value));
+            if (syntax) {
+                appendTypedComparison(filter, syntax, searchDoc);
+                break;
+            }
+            searchDoc.append(kvp(field, value));
             break;
-        case Type::Sub: {
-            using SubType = Ldap::Search::SubFilter::Type;
-            std::stringstream subBuffer;
-            for (auto && c: filter.subChildren) {
-                switch(c.type) {
-                case SubType::Initial:
-                    subBuffer << "^" << c.value;
-                    break;
-                case SubType::Any:
-                    subBuffer << ".+" << c.value;
-                    break;
-                case SubType::Final:
-                    subBuffer << ".+" << c.value << "$";
-                    break;
-                }
+        case Type::Sub:
+            // None of the typed syntaxes have a substring matching rule.
+            if (syntax) {
+                appendNoMatch(searchDoc);
+                break;
             }
-            searchDoc.append(kvp(filter.attributeName,
-                    bsoncxx::types::b_regex{ subBuffer.str(), "" }));
-                        }
+            appendSubstringFilter(filter, isNormalized, searchDoc);
             break;
         case Type::Gte:
-            searchDoc.append(kvp(filter.attributeName, [filter](sub_document gteDoc) {
-                gteDoc.append(kvp("$gte", filter.value));
+            if (syntax) {
+                appendTypedComparison(filter, syntax, searchDoc);
+                break;
+            }
+            searchDoc.append(kvp(field, [&value](sub_document gteDoc) {
+                gteDoc.append(kvp("$gte", value));
             }));
             break;
         case Type::Lte:
-            searchDoc.append(kvp(filter.attributeName, [filter](sub_document lteDoc) {
-                lteDoc.append(kvp("$lte", filter.value));
+            if (syntax) {
+                appendTypedComparison(filter, syntax, searchDoc);
+                break;
+            }
+            searchDoc.append(kvp(field, [&value](sub_document lteDoc) {
+                lteDoc.append(kvp("$lte", value));
             }));
             break;
         case Type::Present:
@@ -285,30 +1523,49 @@ void processFilter(Ldap::Search::Filter filter, sub_document & searchDoc) {
     }
 }
 
-std::unique_ptr<MongoCursor> MongoBackend::findEntries(Ldap::Search::Request req) {
+bsoncxx::document::value scopeQuery(const std::string& baseDn,
+        Ldap::Search::Request::Scope scope) {
+    auto query = document{};
+    appendScope(dnPartsToId(dnToList(baseDn)), scope, query);
+    return query.extract();
+}
+
+std::unique_ptr<MongoCursor> MongoBackend::findEntries(const Ldap::Search::Request& req,
+        const SearchPage* page) {
     auto searchDocument = document{};
-    auto baseDnId = dnPartsToId(dnToList(req.base));
-    using Scope = Ldap::Search::Request::Scope;
 
-    std::stringstream regexBuf;
-    regexBuf << "^" << baseDnId;
-    switch(req.scope) {
-    case Scope::One:
-        regexBuf << ",?[^,]+";
-        break;
-    case Scope::Sub:
-        regexBuf << ",?.+";
-        break;
-    case Scope::Base:
-        regexBuf << "$";
-        break;
-    }
-    searchDocument.append(kvp("_id", bsoncxx::types::b_regex{ regexBuf.str(), "" }));
-    processFilter(req.filter, searchDocument);
+    // The scope, the page and the filter each go in their own clause so they can't clobber
+    // each other's _id or $or.
+    searchDocument.append(kvp("$and", [&](sub_array clauses) {
+        clauses.append(scopeQuery(req.base, req.scope));
+        // Pages are keyed off the last _id returned rather than skipping, so each page
+        // costs the same no matter how deep into the results it is.
+        if (page != nullptr && !page->afterId.empty()) {
+            clauses.append([&](sub_document pageDoc) {
+                pageDoc.append(kvp("_id", [&](sub_document afterDoc) {
+                    afterDoc.append(kvp("$gt", page->afterId));
+                }));
+            });
+        }
+        clauses.append([&](sub_document filterDoc) {
+            processFilter(req.filter, _normalized, _schema, filterDoc);
+        });
+    }));
 
     mongocxx::options::find opts;
-    if (req.sizeLimit > 0) {
-        opts.limit(req.sizeLimit);
+    opts.batch_size(static_cast<int32_t>(cursorBatchSize));
+    if (page != nullptr) {
+        auto sort = document{};
+        sort.append(kvp("_id", 1));
+        opts.sort(sort.extract());
+    }
+
+    int64_t limit = req.sizeLimit;
+    if (page != nullptr && (limit == 0 || page->size < static_cast<size_t>(limit))) {
+        limit = page->size + 1;
+    }
+    if (limit > 0) {
+        opts.limit(limit);
     }
 
     if (req.timeLimit > 0) {
@@ -331,20 +1588,23 @@ std::unique_ptr<MongoCursor> MongoBackend::findEntries(Ldap::Search::Request req
     LOG_S(INFO) << "Executing search for " << bsoncxx::to_json(searchDocument);
 
     auto view = searchDocument.view();
-    auto cursor = _collection.find(view, opts);
-    return std::unique_ptr<MongoCursor>(new MongoCursor{ std::move(cursor) });
+    auto client = acquireClient();
+    auto cursor = collection(client).find(view, opts);
+    return std::unique_ptr<MongoCursor>(new MongoCursor{ std::move(client), std::move(cursor) });
 }
 
 void MongoBackend::deleteEntry(std::string dn) {
-    auto searchDoc = document{};
-    std::stringstream regexBuf;
-
-    regexBuf << "^" << dnPartsToId(dnToList(dn)) << ",?.+";
-
-    searchDoc.append(kvp("_id", bsoncxx::types::b_regex{ regexBuf.str(), "" }));
+    auto dnId = dnPartsToId(dnToList(dn));
+    // The root DSE isn't an entry, and deleting everything under it would empty the directory.
+    if (dnId.empty())
+        throw Ldap::Exception(Ldap::ErrorCode::unwillingToPerform);
+    auto searchDoc = scopeQuery(dn, Ldap::Search::Request::Scope::Sub);
     try {
-        _collection.delete_many(searchDoc.view());
+        auto client = acquireClient();
+        collection(client).delete_many(searchDoc.view());
+        _cache.invalidateSubtree(dnId);
     } catch (const mongocxx::exception& e) {
+        _cache.invalidateSubtree(dnId);
         LOG_S(ERROR) << "Error deleting sub-tree " << dn << ": " << e.what();
         throw Ldap::Exception(Ldap::ErrorCode::operationsError, e.what());
     }
@@ -1,9 +1,22 @@
 #include <termios.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iomanip>
 #include <iostream>
+#include <limits>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <openssl/evp.h>
 
 #include "passwords.h"
+#include "pbkdf2.h"
+#include "scram.h"
 
 std::string readPassword(const char* prompt) {
     std::cout << prompt;
@@ -23,7 +36,226 @@ std::string readPassword(const char* prompt) {
     return password;
 }
 
-int main() {
+// Runs fn over and over on each of threads threads for about a second and returns how many
+// verifications per second they managed between them, given that each call does perCall of
+// them.
+template <typename Fn>
+double measure(Fn fn, size_t perCall, size_t threads = 1) {
+    using Clock = std::chrono::steady_clock;
+    std::atomic<size_t> done{0};
+    auto start = Clock::now();
+    auto deadline = start + std::chrono::seconds(1);
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < threads; i++) {
+        workers.emplace_back([&]() {
+            size_t mine = 0;
+            while (Clock::now() < deadline) {
+                fn();
+                mine += perCall;
+            }
+            done += mine;
+        });
+    }
+    for (auto& t: workers) {
+        t.join();
+    }
+    return done / std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+struct BenchmarkOptions {
+    size_t maxThreads = std::max<size_t>(1, std::thread::hardware_concurrency());
+    std::vector<uint32_t> rounds{10000, 20000, 50000, 100000};
+    double targetMS = 25;
+};
+
+// Verifications per second for one hash, checked in batches that fill the PBKDF2 lanes the
+// way the server's hash pool does.
+double measureHash(const std::string& password, const std::string& hash, size_t threads) {
+    auto batchSize = Password::pbkdf2Lanes();
+    return measure([&]() {
+        std::vector<Password::PasswordCheck> checks(batchSize,
+            Password::PasswordCheck{password, hash, false, nullptr});
+        Password::checkPasswords(checks);
+    }, batchSize, threads);
+}
+
+// Time for one verification on its own, which is what a client waits for when the server
+// isn't busy.
+double measureLatencyMS(const std::string& password, const std::string& hash) {
+    return 1000 / measure([&]() {
+        Password::checkPassword(password, hash);
+    }, 1);
+}
+
+// Verifications per second for V2 at rounds done one at a time by OpenSSL, the baseline the
+// batched PBKDF2 is measured against.
+double measureOpenSsl(const std::string& password, uint32_t rounds, size_t threads) {
+    return measure([&]() {
+        // The same sizes as a V2 hash: a 32 byte salt and a 64 byte key.
+        std::vector<uint8_t> salt(32), key(64);
+        PKCS5_PBKDF2_HMAC(password.data(), password.size(), salt.data(), salt.size(), rounds,
+            EVP_sha512(), key.size(), key.data());
+    }, 1, threads);
+}
+
+// Parses a count that must be at least 1 and fit in 32 bits. Throws std::invalid_argument
+// otherwise.
+uint32_t parseCount(const std::string& value) {
+    size_t end = 0;
+    auto count = std::stoul(value, &end);
+    if (end != value.size() || count == 0 || count > std::numeric_limits<uint32_t>::max())
+        throw std::invalid_argument("expected a positive count, got " + value);
+    return static_cast<uint32_t>(count);
+}
+
+// Prints verifications per second for every registered scheme, and for V2 at each of
+// options.rounds, at 1, 2, 4 ... up to maxThreads threads. Each V2 row is followed by OpenSSL
+// doing the same work one verification at a time, which shows what the batching gains. Then
+// works out how many V2 rounds one verification can afford within options.targetMS.
+int benchmark(const BenchmarkOptions& options) {
+    const std::string password = "benchmark password";
+
+    std::vector<std::shared_ptr<const Password::Scheme>> schemes;
+    for (const auto& scheme: Password::registeredSchemes()) {
+        if (scheme->name() != Password::Pbkdf2Scheme::v2(1)->name())
+            schemes.push_back(scheme);
+    }
+    for (auto rounds: options.rounds) {
+        schemes.push_back(Password::Pbkdf2Scheme::v2(rounds));
+    }
+
+    std::vector<size_t> threadCounts;
+    for (size_t threads = 1; threads < options.maxThreads; threads *= 2) {
+        threadCounts.push_back(threads);
+    }
+    threadCounts.push_back(options.maxThreads);
+
+    std::cout << "PBKDF2 lanes on this CPU: " << Password::pbkdf2Lanes() << std::endl;
+    std::cout << "Latency is one verification by itself. The thread columns are "
+        << "verifications per second." << std::endl << std::endl;
+    std::cout << std::fixed << std::setprecision(1);
+    std::cout << std::left << std::setw(16) << "scheme" << std::right
+        << std::setw(8) << "rounds" << std::setw(12) << "latency ms";
+    for (auto threads: threadCounts) {
+        std::stringstream heading;
+        heading << threads << (threads == 1 ? " thread" : " threads");
+        std::cout << std::setw(16) << heading.str();
+    }
+    std::cout << std::endl;
+
+    // Batched over OpenSSL verifications per second on one thread, for each V2 rounds.
+    std::vector<std::pair<uint32_t, double>> gains;
+    for (const auto& scheme: schemes) {
+        auto hash = scheme->hash(password);
+        auto pbkdf2 = std::dynamic_pointer_cast<const Password::Pbkdf2Scheme>(scheme);
+        std::cout << std::left << std::setw(16) << scheme->name() << std::right
+            << std::setw(8) << (pbkdf2 ? std::to_string(pbkdf2->rounds()) : "-")
+            << std::setw(12) << measureLatencyMS(password, hash);
+        std::vector<double> rates;
+        for (auto threads: threadCounts) {
+            rates.push_back(measureHash(password, hash, threads));
+            std::cout << std::setw(16) << rates.back() << std::flush;
+        }
+        std::cout << std::endl;
+        if (!pbkdf2 || scheme->name() != Password::Pbkdf2Scheme::v2(1)->name())
+            continue;
+
+        std::cout << std::left << std::setw(16) << "  OpenSSL" << std::right
+            << std::setw(8) << pbkdf2->rounds()
+            << std::setw(12) << 1000 / measureOpenSsl(password, pbkdf2->rounds(), 1);
+        for (size_t i = 0; i < threadCounts.size(); i++) {
+            auto baseline = measureOpenSsl(password, pbkdf2->rounds(), threadCounts[i]);
+            std::cout << std::setw(16) << baseline << std::flush;
+            if (i == 0)
+                gains.emplace_back(pbkdf2->rounds(), rates[0] / baseline);
+        }
+        std::cout << std::endl;
+    }
+
+    std::cout << std::endl << "Batched PBKDF2 over OpenSSL on one thread:";
+    for (const auto& gain: gains) {
+        std::cout << " " << gain.second << "x at " << gain.first << " rounds"
+            << (&gain == &gains.back() ? "" : ",");
+    }
+    std::cout << std::endl;
+
+    // PBKDF2's cost is linear in its rounds, so scale from a measurement at a known count
+    // and then check the answer.
+    const uint32_t probeRounds = 10000;
+    auto probeMS = measureLatencyMS(password,
+        Password::Pbkdf2Scheme::v2(probeRounds)->hash(password));
+    auto rounds = static_cast<uint32_t>(probeRounds * options.targetMS / probeMS);
+    rounds = std::max<uint32_t>(1000, rounds / 1000 * 1000);
+    auto calibrated = Password::Pbkdf2Scheme::v2(rounds)->hash(password);
+    std::cout << std::endl << "For " << options.targetMS << " ms per verification use rounds: "
+        << rounds << " (measured " << measureLatencyMS(password, calibrated) << " ms, "
+        << measureHash(password, calibrated, options.maxThreads) << " verifications/s on "
+        << options.maxThreads << (options.maxThreads == 1 ? " thread)" : " threads)")
+        << std::endl;
+    return 0;
+}
+
+int usage(const char* argv0) {
+    std::cerr << "Usage: " << argv0 << std::endl
+        << "       " << argv0 << " --scram [--iterations N]" << std::endl
+        << "       " << argv0 << " --benchmark [--threads N] [--rounds R[,R...]]"
+        << " [--target-ms MS]" << std::endl;
+    return 1;
+}
+
+int main(int argc, char** argv) {
+    if (argc > 1 && std::string(argv[1]) == "--benchmark") {
+        BenchmarkOptions options;
+        try {
+            for (int i = 2; i < argc; i += 2) {
+                std::string arg(argv[i]);
+                if (i + 1 >= argc)
+                    return usage(argv[0]);
+                std::string value(argv[i + 1]);
+                if (arg == "--threads") {
+                    options.maxThreads = parseCount(value);
+                } else if (arg == "--rounds") {
+                    options.rounds.clear();
+                    std::stringstream list(value);
+                    std::string rounds;
+                    while (std::getline(list, rounds, ',')) {
+                        options.rounds.push_back(parseCount(rounds));
+                    }
+                    if (options.rounds.empty())
+                        return usage(argv[0]);
+                } else if (arg == "--target-ms") {
+                    options.targetMS = std::stod(value);
+                    if (!(options.targetMS > 0))
+                        return usage(argv[0]);
+                } else {
+                    return usage(argv[0]);
+                }
+            }
+        } catch (const std::exception&) {
+            return usage(argv[0]);
+        }
+        return benchmark(options);
+    }
+
+    // SCRAM credentials work for simple binds too, and let clients use SCRAM-SHA-256.
+    std::shared_ptr<const Password::Scheme> scheme = Password::preferredScheme();
+    if (argc > 1 && std::string(argv[1]) == "--scram") {
+        uint32_t iterations = std::dynamic_pointer_cast<const Password::ScramScheme>(
+            Password::findScheme("{SCRAM-SHA-256}"))->iterations();
+        if (argc == 4 && std::string(argv[2]) == "--iterations") {
+            try {
+                iterations = parseCount(argv[3]);
+            } catch (const std::exception&) {
+                return usage(argv[0]);
+            }
+        } else if (argc != 2) {
+            return usage(argv[0]);
+        }
+        scheme = std::make_shared<Password::ScramScheme>(iterations);
+    } else if (argc > 1) {
+        return usage(argv[0]);
+    }
+
     auto password = readPassword("Enter password: ");
     auto passwordCheck = readPassword("Re-enter password: ");
     if (password != passwordCheck) {
@@ -31,6 +263,6 @@ int main() {
         exit(1);
     }
 
-    std::cout << Password::generatePassword(password) << std::endl;
+    std::cout << scheme->hash(password) << std::endl;
     return 0;
 }
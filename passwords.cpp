@@ -1,6 +1,9 @@
 #include <iterator>
 #include <fstream>
+#include <map>
+#include <mutex>
 #include <sstream>
+#include <stdexcept>
 #include <vector>
 
 #include <openssl/evp.h>
@@ -9,109 +12,307 @@
 #include <openssl/buffer.h>
 
 #include "passwords.h"
+#include "pbkdf2.h"
+#include "scram.h"
 
 namespace Password {
 
-const std::string PasswordSchemeName = "{NF-PBKDF2-V1}";
+namespace {
+
 const auto saltLength = 32;
-const auto keyLength = 128;
-const auto pbkdfRounds = 10000;
-
-// This is a password hashing scheme for no frills LDAP. It uses PBKDF2 to hash your password
-// 10000 times with a salt with SHA215 as the HMAC algorithm.
-//
-// The name of the scheme encoded in the hash string is NF-PBKDF2-V1, signifying the algorithm
-// used to derive the key, that this is super specific to no frills LDAP, and that I may come
-// up with a better scheme later.
-//
-// Ideally, this will support different schemes later, but I wanted to support real binds early
-// on.
-std::string computeHash(const std::string password, const std::vector<uint8_t> salt) {
-    std::vector<uint8_t> rawChecksum(keyLength);
-    PKCS5_PBKDF2_HMAC(
-        password.c_str(),
-        password.size(),
-        salt.data(),
-        salt.size(),
-        pbkdfRounds,
-        EVP_sha512(),
-        rawChecksum.size(),
-        rawChecksum.data()
-    );
+const uint32_t defaultRounds = 10000;
+
+std::vector<uint8_t> randomBytes(size_t length) {
+    std::ifstream urandom("/dev/urandom", std::ios::binary);
+    urandom.unsetf(std::ios::skipws);
+
+    std::vector<uint8_t> ret(length);
+    urandom.read(reinterpret_cast<char*>(ret.data()), ret.size());
+    return ret;
+}
+
+size_t base64Length(const std::string& s) {
+    auto padding = 0;
+
+    if (s.size() < 2)
+        return 0;
+    if (s[s.size() - 1] == '=' && s[s.size() - 2] == '=')
+        padding = 2;
+    else if (s[s.size() - 1] == '=')
+        padding = 1;
+
+    return (s.size() * 3) / 4 - padding;
+}
+
+bool constantTimeEquals(const std::vector<uint8_t>& a, const std::vector<uint8_t>& b) {
+    if (a.size() != b.size())
+        return false;
+    uint8_t xorByte = 0;
+    for (size_t i = 0; i < a.size(); i++) {
+        xorByte |= a[i] ^ b[i];
+    }
+    return xorByte == 0;
+}
+
+struct Registry {
+    std::mutex lock;
+    std::map<std::string, std::shared_ptr<const Scheme>> schemes;
+    std::shared_ptr<const Scheme> preferred;
 
+    Registry() {
+        schemes[Pbkdf2Scheme::v1()->name()] = Pbkdf2Scheme::v1();
+        preferred = Pbkdf2Scheme::v2(defaultRounds);
+        schemes[preferred->name()] = preferred;
+        auto scram = std::make_shared<ScramScheme>();
+        schemes[scram->name()] = scram;
+    }
+};
+
+Registry& registry() {
+    static Registry registry;
+    return registry;
+}
+
+std::string schemeName(const std::string& hashedPassword) {
+    if (hashedPassword.empty() || hashedPassword[0] != '{')
+        return std::string{};
+    auto end = hashedPassword.find('}');
+    if (end == std::string::npos)
+        return std::string{};
+    return hashedPassword.substr(0, end + 1);
+}
+
+} // namespace
+
+std::string base64Encode(const std::vector<uint8_t>& data) {
     BIO* b64 = BIO_new(BIO_f_base64());
     BIO* bio = BIO_new(BIO_s_mem());
     bio = BIO_push(b64, bio);
 
     BIO_set_flags(bio, BIO_FLAGS_BASE64_NO_NL);
-    BIO_write(bio, salt.data(), salt.size());
-    BIO_write(bio, rawChecksum.data(), rawChecksum.size());
+    BIO_write(bio, data.data(), data.size());
     BIO_flush(bio);
 
     BUF_MEM* bufferPtr;
     BIO_get_mem_ptr(bio, &bufferPtr);
-
-    std::stringstream strBuf;
-    strBuf << PasswordSchemeName << bufferPtr->data;
+    std::string ret(bufferPtr->data, bufferPtr->length);
     BIO_free_all(bio);
 
-    return strBuf.str();
+    return ret;
 }
 
-size_t base64Length(const std::vector<uint8_t> s) {
-    auto padding = 0;
+std::vector<uint8_t> base64Decode(const std::string& encoded) {
+    if (encoded.size() % 4 != 0)
+        throw std::invalid_argument("invalid base64");
+    std::vector<uint8_t> ret(base64Length(encoded));
+    auto bio = BIO_new_mem_buf(encoded.data(), encoded.size());
+    auto b64 = BIO_new(BIO_f_base64());
+    bio = BIO_push(b64, bio);
+    BIO_set_flags(bio, BIO_FLAGS_BASE64_NO_NL);
+    auto length = BIO_read(bio, ret.data(), ret.size());
+    BIO_free_all(bio);
 
-    if (s[s.size() - 1] == '=' && s[s.size() - 2] == '=')
-        padding = 2;
-    else if (s[s.size() - 1] == '=')
-        padding = 1;
+    if (length < 0 || static_cast<size_t>(length) != ret.size())
+        throw std::invalid_argument("invalid base64");
+    return ret;
+}
 
-    return (s.size() * 3) / 4 - padding;
+Pbkdf2Scheme::Pbkdf2Scheme(std::string name, size_t keyLength, uint32_t rounds,
+        bool storesRounds):
+    _name{std::move(name)},
+    _keyLength{keyLength},
+    _rounds{rounds},
+    _storesRounds{storesRounds}
+{}
+
+std::shared_ptr<Pbkdf2Scheme> Pbkdf2Scheme::v1() {
+    return std::shared_ptr<Pbkdf2Scheme>(
+        new Pbkdf2Scheme("{NF-PBKDF2-V1}", 128, defaultRounds, false));
 }
 
-std::string generatePassword(std::string password) {
-    std::ifstream urandom("/dev/urandom", std::ios::binary);
-    urandom.unsetf(std::ios::skipws);
+std::shared_ptr<Pbkdf2Scheme> Pbkdf2Scheme::v2(uint32_t rounds) {
+    if (rounds == 0)
+        throw std::invalid_argument("PBKDF2 rounds must be at least 1");
+    return std::shared_ptr<Pbkdf2Scheme>(
+        new Pbkdf2Scheme("{NF-PBKDF2-V2}", 64, rounds, true));
+}
 
-    std::vector<uint8_t> saltVector(saltLength);
-    urandom.read(reinterpret_cast<char*>(saltVector.data()), saltVector.size());
+std::string Pbkdf2Scheme::encode(uint32_t rounds, const std::vector<uint8_t>& salt,
+        const std::vector<uint8_t>& key) const {
+    std::vector<uint8_t> saltAndKey(salt);
+    saltAndKey.insert(saltAndKey.end(), key.begin(), key.end());
 
-    return computeHash(password, saltVector);
+    std::stringstream strBuf;
+    strBuf << _name;
+    if (_storesRounds)
+        strBuf << rounds << "$";
+    strBuf << base64Encode(saltAndKey);
+    return strBuf.str();
 }
 
-bool checkPassword(std::string password, std::string rawHashedPassword) {
-    if (rawHashedPassword.find(PasswordSchemeName) != 0)
+void Pbkdf2Scheme::decode(const std::string& hashedPassword, uint32_t& rounds,
+        std::vector<uint8_t>& salt, std::vector<uint8_t>& key) const {
+    if (hashedPassword.compare(0, _name.size(), _name) != 0)
         throw std::invalid_argument("hashed password has invalid scheme");
 
-    std::vector<uint8_t> hashedPassword;
-    std::copy(rawHashedPassword.begin() + PasswordSchemeName.size(), rawHashedPassword.end(),
-            std::back_inserter(hashedPassword));
-    auto decodeLen = base64Length(hashedPassword);
-    if (decodeLen != (saltLength + keyLength))
+    auto encodedStart = _name.size();
+    rounds = _rounds;
+    if (_storesRounds) {
+        auto sep = hashedPassword.find('$', encodedStart);
+        if (sep == std::string::npos || sep == encodedStart)
+            throw std::invalid_argument("hashed password is missing its rounds");
+        auto roundsStr = hashedPassword.substr(encodedStart, sep - encodedStart);
+        if (roundsStr.find_first_not_of("0123456789") != std::string::npos ||
+                roundsStr.size() > 9)
+            throw std::invalid_argument("hashed password has invalid rounds");
+        rounds = static_cast<uint32_t>(std::stoul(roundsStr));
+        if (rounds == 0)
+            throw std::invalid_argument("hashed password has invalid rounds");
+        encodedStart = sep + 1;
+    }
+
+    auto encoded = hashedPassword.substr(encodedStart);
+    if (base64Length(encoded) != (saltLength + _keyLength))
         throw std::invalid_argument("hashed password has invalid length");
+    auto saltAndKey = base64Decode(encoded);
+    salt.assign(saltAndKey.begin(), saltAndKey.begin() + saltLength);
+    key.assign(saltAndKey.begin() + saltLength, saltAndKey.end());
+}
 
-    auto bio = BIO_new_mem_buf(
-        hashedPassword.data(),
-        hashedPassword.size()
-    );
-    auto b64 = BIO_new(BIO_f_base64());
-    bio = BIO_push(b64, bio);
-    BIO_set_flags(bio, BIO_FLAGS_BASE64_NO_NL);
+std::string Pbkdf2Scheme::hash(const std::string& password) const {
+    std::vector<Pbkdf2Job> jobs{
+        Pbkdf2Job{password, randomBytes(saltLength), _rounds, std::vector<uint8_t>(_keyLength)}
+    };
+    pbkdf2Sha512(jobs);
+    return encode(_rounds, jobs[0].salt, jobs[0].key);
+}
 
-    std::vector<uint8_t> saltVector(saltLength);
-    BIO_read(bio, saltVector.data(), saltVector.size());
-    BIO_free_all(bio);
+void Pbkdf2Scheme::verify(const std::vector<PasswordCheck*>& checks) const {
+    std::vector<Pbkdf2Job> jobs;
+    std::vector<std::vector<uint8_t>> expected;
+    std::vector<PasswordCheck*> jobChecks;
+    for (auto check: checks) {
+        try {
+            uint32_t rounds;
+            std::vector<uint8_t> salt, key;
+            decode(check->hashedPassword, rounds, salt, key);
+            jobs.push_back(Pbkdf2Job{check->password, std::move(salt), rounds,
+                std::vector<uint8_t>(_keyLength)});
+            expected.push_back(std::move(key));
+            jobChecks.push_back(check);
+        } catch (const std::exception&) {
+            check->error = std::current_exception();
+        }
+    }
 
-    auto checkHash = computeHash(password, saltVector);
+    pbkdf2Sha512(jobs);
 
-    if (rawHashedPassword.size() != checkHash.size())
-        return false;
+    for (size_t i = 0; i < jobs.size(); i++) {
+        jobChecks[i]->matched = constantTimeEquals(jobs[i].key, expected[i]);
+    }
+}
 
-    uint8_t xorByte = 0;
-    for (size_t i = 0; i < checkHash.size(); i++) {
-        xorByte |= checkHash[i] ^ rawHashedPassword[i];
+bool Pbkdf2Scheme::outdated(const std::string& hashedPassword) const {
+    try {
+        uint32_t rounds;
+        std::vector<uint8_t> salt, key;
+        decode(hashedPassword, rounds, salt, key);
+        return rounds < _rounds;
+    } catch (const std::exception&) {
+        return true;
+    }
+}
+
+void registerScheme(std::shared_ptr<const Scheme> scheme) {
+    auto& reg = registry();
+    std::lock_guard<std::mutex> guard(reg.lock);
+    if (reg.preferred->name() == scheme->name())
+        reg.preferred = scheme;
+    reg.schemes[scheme->name()] = std::move(scheme);
+}
+
+void setPreferredScheme(const std::string& name) {
+    auto fullName = (!name.empty() && name[0] == '{') ? name : "{" + name + "}";
+    auto& reg = registry();
+    std::lock_guard<std::mutex> guard(reg.lock);
+    auto it = reg.schemes.find(fullName);
+    if (it == reg.schemes.end())
+        throw std::invalid_argument("unknown password scheme " + name);
+    reg.preferred = it->second;
+}
+
+std::shared_ptr<const Scheme> preferredScheme() {
+    auto& reg = registry();
+    std::lock_guard<std::mutex> guard(reg.lock);
+    return reg.preferred;
+}
+
+std::shared_ptr<const Scheme> findScheme(const std::string& hashedPassword) {
+    auto& reg = registry();
+    std::lock_guard<std::mutex> guard(reg.lock);
+    auto it = reg.schemes.find(schemeName(hashedPassword));
+    if (it == reg.schemes.end())
+        return nullptr;
+    return it->second;
+}
+
+std::vector<std::shared_ptr<const Scheme>> registeredSchemes() {
+    auto& reg = registry();
+    std::lock_guard<std::mutex> guard(reg.lock);
+    std::vector<std::shared_ptr<const Scheme>> ret;
+    for (const auto& scheme: reg.schemes) {
+        ret.push_back(scheme.second);
+    }
+    return ret;
+}
+
+bool needsRehash(const std::string& hashedPassword) {
+    auto scheme = findScheme(hashedPassword);
+    if (!scheme)
+        return true;
+    if (scheme == preferredScheme() || !scheme->replaceable())
+        return scheme->outdated(hashedPassword);
+    return true;
+}
+
+std::string rehash(const std::string& hashedPassword, const std::string& password) {
+    auto scheme = findScheme(hashedPassword);
+    if (scheme && !scheme->replaceable())
+        return scheme->hash(password);
+    return generatePassword(password);
+}
+
+std::string generatePassword(std::string password) {
+    return preferredScheme()->hash(password);
+}
+
+bool checkPassword(std::string password, std::string rawHashedPassword) {
+    std::vector<PasswordCheck> checks{
+        PasswordCheck{std::move(password), std::move(rawHashedPassword), false, nullptr}
+    };
+    checkPasswords(checks);
+    if (checks[0].error)
+        std::rethrow_exception(checks[0].error);
+    return checks[0].matched;
+}
+
+void checkPasswords(std::vector<PasswordCheck>& checks) {
+    std::map<std::shared_ptr<const Scheme>, std::vector<PasswordCheck*>> byScheme;
+    for (auto& check: checks) {
+        check.matched = false;
+        check.error = nullptr;
+        auto scheme = findScheme(check.hashedPassword);
+        if (!scheme) {
+            check.error = std::make_exception_ptr(
+                std::invalid_argument("hashed password has invalid scheme"));
+            continue;
+        }
+        byScheme[scheme].push_back(&check);
+    }
+
+    for (const auto& schemeChecks: byScheme) {
+        schemeChecks.first->verify(schemeChecks.second);
     }
-    return xorByte == 0;
 }
 
 } // namespace Password
@@ -1,9 +1,109 @@
+#pragma once
+
+#include <cstdint>
+#include <exception>
+#include <memory>
 #include <string>
+#include <vector>
 
 namespace Password {
 
+// Checks password against a hash made by any registered scheme. Throws
+// std::invalid_argument if the hash isn't one we understand.
 bool checkPassword(std::string password, std::string rawHashedPassword);
+// Hashes password with the preferred scheme.
 std::string generatePassword(std::string password);
 
-} // namespace password
+struct PasswordCheck {
+    std::string password;
+    std::string hashedPassword;
+    // Filled in by checkPasswords.
+    bool matched;
+    std::exception_ptr error;
+};
+
+// Checks a batch of passwords, with the same results as calling checkPassword on each one
+// except that a hash that can't be checked gets its error set instead of throwing. Schemes
+// get all of their checks at once, so PBKDF2 work can share SIMD lanes.
+void checkPasswords(std::vector<PasswordCheck>& checks);
+
+// A way of hashing passwords. Every hash starts with the scheme's name in braces, which is
+// how checkPassword knows which scheme to hand it to.
+class Scheme {
+public:
+    virtual ~Scheme() {}
+
+    // The prefix on every hash this scheme makes, braces included.
+    virtual const std::string& name() const = 0;
+    virtual std::string hash(const std::string& password) const = 0;
+    // Sets matched or error on each check. Every check has a hash with this scheme's name.
+    virtual void verify(const std::vector<PasswordCheck*>& checks) const = 0;
+    // True if hashedPassword is weaker than what hash() would make now, e.g. it has fewer
+    // rounds than the scheme is currently configured for.
+    virtual bool outdated(const std::string& hashedPassword) const = 0;
+    // False if this scheme's hashes are needed for something besides simple binds, so they
+    // shouldn't be replaced by the preferred scheme's. They're still rehashed with this
+    // scheme when they're outdated.
+    virtual bool replaceable() const { return true; }
+};
+
+// PBKDF2-HMAC-SHA512 with a random 32 byte salt.
+//
+// {NF-PBKDF2-V1} was the original scheme: 10000 rounds and a 128 byte key, stored as
+// base64(salt + key). A 128 byte key takes two PBKDF2 chains, doubling the work of a bind
+// without making the hash any harder to attack, since an attacker only needs one of them.
+//
+// {NF-PBKDF2-V2} derives a 64 byte key, so it's one chain, and stores its rounds so they can
+// be raised later without breaking existing hashes: rounds$base64(salt + key).
+class Pbkdf2Scheme : public Scheme {
+public:
+    static std::shared_ptr<Pbkdf2Scheme> v1();
+    static std::shared_ptr<Pbkdf2Scheme> v2(uint32_t rounds);
+
+    const std::string& name() const override { return _name; }
+    std::string hash(const std::string& password) const override;
+    void verify(const std::vector<PasswordCheck*>& checks) const override;
+    bool outdated(const std::string& hashedPassword) const override;
+
+    uint32_t rounds() const { return _rounds; }
+
+private:
+    Pbkdf2Scheme(std::string name, size_t keyLength, uint32_t rounds, bool storesRounds);
+
+    std::string encode(uint32_t rounds, const std::vector<uint8_t>& salt,
+        const std::vector<uint8_t>& key) const;
+    // Throws std::invalid_argument if the hash is malformed.
+    void decode(const std::string& hashedPassword, uint32_t& rounds,
+        std::vector<uint8_t>& salt, std::vector<uint8_t>& key) const;
+
+    const std::string _name;
+    const size_t _keyLength;
+    const uint32_t _rounds;
+    const bool _storesRounds;
+};
+
+// The registry starts out with {NF-PBKDF2-V1}, {NF-PBKDF2-V2} at 10000 rounds and
+// {SCRAM-SHA-256} at 10000 iterations, preferring V2. Registering a scheme with the same name
+// as an existing one replaces it, which is how the V2 rounds get configured. Configure the
+// registry before any threads start using it.
+void registerScheme(std::shared_ptr<const Scheme> scheme);
+// Throws std::invalid_argument if there's no scheme with that name.
+void setPreferredScheme(const std::string& name);
+std::shared_ptr<const Scheme> preferredScheme();
+// Returns nullptr if no registered scheme made this hash.
+std::shared_ptr<const Scheme> findScheme(const std::string& hashedPassword);
+std::vector<std::shared_ptr<const Scheme>> registeredSchemes();
+
+// True if a hash should be replaced the next time we see the password it was made from,
+// because it's from a scheme other than the preferred one or the preferred scheme's
+// settings have been raised since.
+bool needsRehash(const std::string& hashedPassword);
+// Makes the replacement for a hash that needsRehash said yes to.
+std::string rehash(const std::string& hashedPassword, const std::string& password);
+
+// Standard base64, padded and without line breaks.
+std::string base64Encode(const std::vector<uint8_t>& data);
+// Throws std::invalid_argument if encoded isn't valid base64.
+std::vector<uint8_t> base64Decode(const std::string& encoded);
 
+} // namespace Password
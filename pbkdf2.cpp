@@ -0,0 +1,369 @@
+#include <algorithm>
+#include <array>
+#include <cstring>
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define NF_PBKDF2_AVX2 1
+#endif
+
+#include "pbkdf2.h"
+
+namespace Password {
+
+namespace {
+
+const size_t blockSize = 128;
+const size_t digestSize = 64;
+const size_t maxLanes = 4;
+
+// Every message hashed while iterating is one 128-byte key block followed by one 64-byte
+// digest, so the padding and length at the end of the second block never change.
+const uint64_t paddingWord = 0x8000000000000000ULL;
+const uint64_t messageBits = (blockSize + digestSize) * 8;
+
+const uint64_t sha512IV[8] = {
+    0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL, 0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+    0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL, 0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL,
+};
+
+const uint64_t sha512K[80] = {
+    0x428a2f98d728ae22ULL, 0x7137449123ef65cdULL, 0xb5c0fbcfec4d3b2fULL, 0xe9b5dba58189dbbcULL,
+    0x3956c25bf348b538ULL, 0x59f111f1b605d019ULL, 0x923f82a4af194f9bULL, 0xab1c5ed5da6d8118ULL,
+    0xd807aa98a3030242ULL, 0x12835b0145706fbeULL, 0x243185be4ee4b28cULL, 0x550c7dc3d5ffb4e2ULL,
+    0x72be5d74f27b896fULL, 0x80deb1fe3b1696b1ULL, 0x9bdc06a725c71235ULL, 0xc19bf174cf692694ULL,
+    0xe49b69c19ef14ad2ULL, 0xefbe4786384f25e3ULL, 0x0fc19dc68b8cd5b5ULL, 0x240ca1cc77ac9c65ULL,
+    0x2de92c6f592b0275ULL, 0x4a7484aa6ea6e483ULL, 0x5cb0a9dcbd41fbd4ULL, 0x76f988da831153b5ULL,
+    0x983e5152ee66dfabULL, 0xa831c66d2db43210ULL, 0xb00327c898fb213fULL, 0xbf597fc7beef0ee4ULL,
+    0xc6e00bf33da88fc2ULL, 0xd5a79147930aa725ULL, 0x06ca6351e003826fULL, 0x142929670a0e6e70ULL,
+    0x27b70a8546d22ffcULL, 0x2e1b21385c26c926ULL, 0x4d2c6dfc5ac42aedULL, 0x53380d139d95b3dfULL,
+    0x650a73548baf63deULL, 0x766a0abb3c77b2a8ULL, 0x81c2c92e47edaee6ULL, 0x92722c851482353bULL,
+    0xa2bfe8a14cf10364ULL, 0xa81a664bbc423001ULL, 0xc24b8b70d0f89791ULL, 0xc76c51a30654be30ULL,
+    0xd192e819d6ef5218ULL, 0xd69906245565a910ULL, 0xf40e35855771202aULL, 0x106aa07032bbd1b8ULL,
+    0x19a4c116b8d2d0c8ULL, 0x1e376c085141ab53ULL, 0x2748774cdf8eeb99ULL, 0x34b0bcb5e19b48a8ULL,
+    0x391c0cb3c5c95a63ULL, 0x4ed8aa4ae3418acbULL, 0x5b9cca4f7763e373ULL, 0x682e6ff3d6b2b8a3ULL,
+    0x748f82ee5defb2fcULL, 0x78a5636f43172f60ULL, 0x84c87814a1f0ab72ULL, 0x8cc702081a6439ecULL,
+    0x90befffa23631e28ULL, 0xa4506cebde82bde9ULL, 0xbef9a3f7b2c67915ULL, 0xc67178f2e372532bULL,
+    0xca273eceea26619cULL, 0xd186b8c721c0c207ULL, 0xeada7dd6cde0eb1eULL, 0xf57d4f7fee6ed178ULL,
+    0x06f067aa72176fbaULL, 0x0a637dc5a2c898a6ULL, 0x113f9804bef90daeULL, 0x1b710b35131c471bULL,
+    0x28db77f523047d84ULL, 0x32caab7b40c72493ULL, 0x3c9ebe0a15c9bebcULL, 0x431d67c49c100d4cULL,
+    0x4cc5d4becb3e42b6ULL, 0x597f299cfc657e2aULL, 0x5fcb6fab3ad6faecULL, 0x6c44198c4a475817ULL,
+};
+
+uint64_t loadBigEndian(const uint8_t* p) {
+    uint64_t ret = 0;
+    for (size_t i = 0; i < 8; i++) {
+        ret = (ret << 8) | p[i];
+    }
+    return ret;
+}
+
+void storeBigEndian(uint64_t v, uint8_t* p) {
+    for (size_t i = 0; i < 8; i++) {
+        p[i] = static_cast<uint8_t>(v >> (8 * (7 - i)));
+    }
+}
+
+inline uint64_t ror(uint64_t x, int n) {
+    return (x >> n) | (x << (64 - n));
+}
+
+// One SHA-512 compression of a block that's already been loaded as big-endian words.
+void compress(uint64_t state[8], const uint64_t block[16]) {
+    uint64_t w[80];
+    std::copy(block, block + 16, w);
+    for (size_t i = 16; i < 80; i++) {
+        auto s0 = ror(w[i - 15], 1) ^ ror(w[i - 15], 8) ^ (w[i - 15] >> 7);
+        auto s1 = ror(w[i - 2], 19) ^ ror(w[i - 2], 61) ^ (w[i - 2] >> 6);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    auto a = state[0], b = state[1], c = state[2], d = state[3];
+    auto e = state[4], f = state[5], g = state[6], h = state[7];
+    for (size_t i = 0; i < 80; i++) {
+        auto t1 = h + (ror(e, 14) ^ ror(e, 18) ^ ror(e, 41)) + ((e & f) ^ (~e & g)) +
+            sha512K[i] + w[i];
+        auto t2 = (ror(a, 28) ^ ror(a, 34) ^ ror(a, 39)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+}
+
+// The chains being run side by side. Words are interleaved so that word i of every lane is
+// contiguous, at [i * maxLanes + lane].
+struct Lanes {
+    // SHA-512 state after hashing the password block xored with ipad and opad.
+    uint64_t inner[8 * maxLanes];
+    uint64_t outer[8 * maxLanes];
+    // The last U computed, and the xor of every U so far.
+    uint64_t u[8 * maxLanes];
+    uint64_t t[8 * maxLanes];
+};
+
+void iterateScalar(Lanes& lanes, size_t count, uint32_t iterations) {
+    for (size_t lane = 0; lane < count; lane++) {
+        uint64_t block[16] = {0};
+        block[8] = paddingWord;
+        block[15] = messageBits;
+        for (uint32_t r = 0; r < iterations; r++) {
+            uint64_t state[8];
+            for (size_t i = 0; i < 8; i++) {
+                block[i] = lanes.u[i * maxLanes + lane];
+                state[i] = lanes.inner[i * maxLanes + lane];
+            }
+            compress(state, block);
+            for (size_t i = 0; i < 8; i++) {
+                block[i] = state[i];
+                state[i] = lanes.outer[i * maxLanes + lane];
+            }
+            compress(state, block);
+            for (size_t i = 0; i < 8; i++) {
+                lanes.u[i * maxLanes + lane] = state[i];
+                lanes.t[i * maxLanes + lane] ^= state[i];
+            }
+        }
+    }
+}
+
+#ifdef NF_PBKDF2_AVX2
+#define NF_AVX2 __attribute__((target("avx2")))
+
+// AVX2 has no 64-bit rotate, so it's two shifts and an or.
+template <int N>
+NF_AVX2 inline __m256i rorLanes(__m256i x) {
+    return _mm256_or_si256(_mm256_srli_epi64(x, N), _mm256_slli_epi64(x, 64 - N));
+}
+
+NF_AVX2 inline __m256i xor3(__m256i a, __m256i b, __m256i c) {
+    return _mm256_xor_si256(_mm256_xor_si256(a, b), c);
+}
+
+// The same compression as above, on four independent blocks at once.
+NF_AVX2 void compressLanes(__m256i* state, const __m256i* block) {
+    __m256i w[80];
+    for (size_t i = 0; i < 16; i++) {
+        w[i] = block[i];
+    }
+    for (size_t i = 16; i < 80; i++) {
+        auto s0 = xor3(rorLanes<1>(w[i - 15]), rorLanes<8>(w[i - 15]),
+            _mm256_srli_epi64(w[i - 15], 7));
+        auto s1 = xor3(rorLanes<19>(w[i - 2]), rorLanes<61>(w[i - 2]),
+            _mm256_srli_epi64(w[i - 2], 6));
+        w[i] = _mm256_add_epi64(_mm256_add_epi64(w[i - 16], s0),
+            _mm256_add_epi64(w[i - 7], s1));
+    }
+
+    auto a = state[0], b = state[1], c = state[2], d = state[3];
+    auto e = state[4], f = state[5], g = state[6], h = state[7];
+    for (size_t i = 0; i < 80; i++) {
+        auto sigma1 = xor3(rorLanes<14>(e), rorLanes<18>(e), rorLanes<41>(e));
+        auto ch = _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g));
+        auto t1 = _mm256_add_epi64(_mm256_add_epi64(h, sigma1),
+            _mm256_add_epi64(ch, _mm256_add_epi64(
+                _mm256_set1_epi64x(static_cast<long long>(sha512K[i])), w[i])));
+        auto sigma0 = xor3(rorLanes<28>(a), rorLanes<34>(a), rorLanes<39>(a));
+        auto maj = xor3(_mm256_and_si256(a, b), _mm256_and_si256(a, c),
+            _mm256_and_si256(b, c));
+        auto t2 = _mm256_add_epi64(sigma0, maj);
+        h = g;
+        g = f;
+        f = e;
+        e = _mm256_add_epi64(d, t1);
+        d = c;
+        c = b;
+        b = a;
+        a = _mm256_add_epi64(t1, t2);
+    }
+    state[0] = _mm256_add_epi64(state[0], a);
+    state[1] = _mm256_add_epi64(state[1], b);
+    state[2] = _mm256_add_epi64(state[2], c);
+    state[3] = _mm256_add_epi64(state[3], d);
+    state[4] = _mm256_add_epi64(state[4], e);
+    state[5] = _mm256_add_epi64(state[5], f);
+    state[6] = _mm256_add_epi64(state[6], g);
+    state[7] = _mm256_add_epi64(state[7], h);
+}
+
+NF_AVX2 void iterateAvx2(Lanes& lanes, uint32_t iterations) {
+    __m256i inner[8], outer[8], u[8], t[8];
+    for (size_t i = 0; i < 8; i++) {
+        inner[i] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&lanes.inner[i * 4]));
+        outer[i] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&lanes.outer[i * 4]));
+        u[i] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&lanes.u[i * 4]));
+        t[i] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&lanes.t[i * 4]));
+    }
+
+    __m256i block[16];
+    for (size_t i = 8; i < 16; i++) {
+        block[i] = _mm256_setzero_si256();
+    }
+    block[8] = _mm256_set1_epi64x(static_cast<long long>(paddingWord));
+    block[15] = _mm256_set1_epi64x(static_cast<long long>(messageBits));
+
+    __m256i state[8];
+    for (uint32_t r = 0; r < iterations; r++) {
+        for (size_t i = 0; i < 8; i++) {
+            block[i] = u[i];
+            state[i] = inner[i];
+        }
+        compressLanes(state, block);
+        for (size_t i = 0; i < 8; i++) {
+            block[i] = state[i];
+            state[i] = outer[i];
+        }
+        compressLanes(state, block);
+        for (size_t i = 0; i < 8; i++) {
+            u[i] = state[i];
+            t[i] = _mm256_xor_si256(t[i], state[i]);
+        }
+    }
+
+    for (size_t i = 0; i < 8; i++) {
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(&lanes.u[i * 4]), u[i]);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(&lanes.t[i * 4]), t[i]);
+    }
+}
+
+bool haveAvx2() {
+    static const bool ret = __builtin_cpu_supports("avx2");
+    return ret;
+}
+#else
+bool haveAvx2() {
+    return false;
+}
+#endif
+
+using HmacState = std::array<uint64_t, 8>;
+
+// Hashes the password block xored with pad, which is all HMAC ever does with the key.
+HmacState keyState(const uint8_t* keyBlock, uint8_t pad) {
+    uint64_t block[16];
+    uint8_t padded[blockSize];
+    for (size_t i = 0; i < blockSize; i++) {
+        padded[i] = keyBlock[i] ^ pad;
+    }
+    for (size_t i = 0; i < 16; i++) {
+        block[i] = loadBigEndian(padded + i * 8);
+    }
+
+    HmacState ret;
+    std::copy(sha512IV, sha512IV + 8, ret.begin());
+    compress(ret.data(), block);
+    return ret;
+}
+
+struct Chain {
+    size_t job;
+    // Which 64-byte block of the derived key this chain computes.
+    size_t block;
+};
+
+} // namespace
+
+size_t pbkdf2Lanes() {
+    return haveAvx2() ? maxLanes : 1;
+}
+
+void pbkdf2Sha512(std::vector<Pbkdf2Job>& jobs) {
+    std::vector<HmacState> inner, outer;
+    std::vector<Chain> chains;
+    for (size_t j = 0; j < jobs.size(); j++) {
+        const auto& password = jobs[j].password;
+        uint8_t keyBlock[blockSize] = {0};
+        // HMAC keys longer than a block are hashed first.
+        if (password.size() > blockSize) {
+            unsigned int length = 0;
+            EVP_Digest(password.data(), password.size(), keyBlock, &length, EVP_sha512(),
+                nullptr);
+        } else {
+            std::memcpy(keyBlock, password.data(), password.size());
+        }
+        inner.push_back(keyState(keyBlock, 0x36));
+        outer.push_back(keyState(keyBlock, 0x5c));
+
+        for (size_t b = 0; b * digestSize < jobs[j].key.size(); b++) {
+            chains.push_back(Chain{j, b});
+        }
+    }
+
+    // Lanes run in lockstep, so only chains with the same number of rounds can share them.
+    std::stable_sort(chains.begin(), chains.end(), [&jobs](const Chain& a, const Chain& b) {
+        return jobs[a.job].rounds < jobs[b.job].rounds;
+    });
+
+    auto lanesAvailable = pbkdf2Lanes();
+    for (size_t start = 0; start < chains.size();) {
+        auto rounds = std::max<uint32_t>(jobs[chains[start].job].rounds, 1);
+        size_t count = 1;
+        while (start + count < chains.size() && count < lanesAvailable &&
+                std::max<uint32_t>(jobs[chains[start + count].job].rounds, 1) == rounds) {
+            count++;
+        }
+
+        Lanes lanes;
+        for (size_t lane = 0; lane < maxLanes; lane++) {
+            // Lanes without a chain of their own repeat the first one, and get thrown away.
+            const auto& chain = chains[start + (lane < count ? lane : 0)];
+            const auto& job = jobs[chain.job];
+
+            // U1 is the only HMAC over the salt, so leave it to OpenSSL.
+            std::vector<uint8_t> message(job.salt);
+            uint32_t blockIndex = static_cast<uint32_t>(chain.block + 1);
+            for (int shift = 24; shift >= 0; shift -= 8) {
+                message.push_back(static_cast<uint8_t>(blockIndex >> shift));
+            }
+            uint8_t u1[digestSize];
+            unsigned int length = 0;
+            HMAC(EVP_sha512(), job.password.data(), job.password.size(),
+                message.data(), message.size(), u1, &length);
+
+            for (size_t i = 0; i < 8; i++) {
+                lanes.inner[i * maxLanes + lane] = inner[chain.job][i];
+                lanes.outer[i * maxLanes + lane] = outer[chain.job][i];
+                lanes.u[i * maxLanes + lane] = loadBigEndian(u1 + i * 8);
+                lanes.t[i * maxLanes + lane] = lanes.u[i * maxLanes + lane];
+            }
+        }
+
+        if (lanesAvailable == maxLanes) {
+#ifdef NF_PBKDF2_AVX2
+            iterateAvx2(lanes, rounds - 1);
+#endif
+        } else {
+            iterateScalar(lanes, count, rounds - 1);
+        }
+
+        for (size_t lane = 0; lane < count; lane++) {
+            const auto& chain = chains[start + lane];
+            auto& key = jobs[chain.job].key;
+            uint8_t t[digestSize];
+            for (size_t i = 0; i < 8; i++) {
+                storeBigEndian(lanes.t[i * maxLanes + lane], t + i * 8);
+            }
+            auto offset = chain.block * digestSize;
+            auto length = std::min(digestSize, key.size() - offset);
+            std::copy(t, t + length, key.begin() + offset);
+        }
+        start += count;
+    }
+}
+
+} // namespace Password
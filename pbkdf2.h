@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace Password {
+
+struct Pbkdf2Job {
+    std::string password;
+    std::vector<uint8_t> salt;
+    uint32_t rounds;
+    // Filled in with the derived key. Its size going in is the key length to derive.
+    std::vector<uint8_t> key;
+};
+
+// Runs PBKDF2-HMAC-SHA512 for every job, with output identical to PKCS5_PBKDF2_HMAC using
+// EVP_sha512().
+//
+// Almost all of the work in PBKDF2 is the iterated HMAC, and each 64-byte block of each
+// derived key is an independent chain of it. Chains with the same number of rounds are run
+// side by side, four at a time in AVX2 lanes if the CPU supports it, so checking several
+// passwords at once costs little more than checking one.
+void pbkdf2Sha512(std::vector<Pbkdf2Job>& jobs);
+
+// How many chains run side by side on this CPU.
+size_t pbkdf2Lanes();
+
+} // namespace Password
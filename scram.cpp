@@ -0,0 +1,272 @@
+#include <sstream>
+#include <stdexcept>
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <openssl/sha.h>
+
+#include "scram.h"
+
+namespace Password {
+
+const std::string ScramMechanism = "SCRAM-SHA-256";
+
+namespace {
+
+const std::string SchemeName = "{SCRAM-SHA-256}";
+const size_t saltLength = 16;
+const size_t nonceLength = 24;
+const size_t keyLength = SHA256_DIGEST_LENGTH;
+
+using Bytes = std::vector<uint8_t>;
+
+Bytes hmac(const Bytes& key, const std::string& data) {
+    Bytes ret(keyLength);
+    unsigned int length = ret.size();
+    HMAC(EVP_sha256(), key.data(), key.size(),
+        reinterpret_cast<const unsigned char*>(data.data()), data.size(), ret.data(), &length);
+    return ret;
+}
+
+Bytes sha256(const Bytes& data) {
+    Bytes ret(keyLength);
+    SHA256(data.data(), data.size(), ret.data());
+    return ret;
+}
+
+Bytes randomBytes(size_t length) {
+    Bytes ret(length);
+    if (RAND_bytes(ret.data(), ret.size()) != 1)
+        throw std::runtime_error("Couldn't generate random bytes for SCRAM");
+    return ret;
+}
+
+bool constantTimeEquals(const Bytes& a, const Bytes& b) {
+    if (a.size() != b.size())
+        return false;
+    uint8_t xorByte = 0;
+    for (size_t i = 0; i < a.size(); i++) {
+        xorByte |= a[i] ^ b[i];
+    }
+    return xorByte == 0;
+}
+
+// Made up credentials for users without SCRAM credentials have to look the same every time
+// the same user is asked for, or comparing two challenges would give them away.
+const Bytes& unknownUserKey() {
+    static const Bytes key = randomBytes(keyLength);
+    return key;
+}
+
+// Splits a SCRAM message into its comma separated attr=value fields.
+std::vector<std::string> splitFields(const std::string& message) {
+    std::vector<std::string> fields;
+    std::stringstream stream(message);
+    std::string field;
+    while (std::getline(stream, field, ',')) {
+        fields.push_back(field);
+    }
+    if (!message.empty() && message.back() == ',')
+        fields.push_back("");
+    return fields;
+}
+
+// Returns the value of a field like "r=abc" if it has the attribute we expect.
+std::string fieldValue(const std::string& field, char attribute) {
+    if (field.size() < 2 || field[0] != attribute || field[1] != '=')
+        throw std::invalid_argument(std::string("SCRAM message is missing ") + attribute + "=");
+    return field.substr(2);
+}
+
+std::string unescapeName(const std::string& name) {
+    std::string ret;
+    for (size_t i = 0; i < name.size(); i++) {
+        if (name[i] != '=') {
+            ret.push_back(name[i]);
+        } else if (name.compare(i, 3, "=2C") == 0) {
+            ret.push_back(',');
+            i += 2;
+        } else if (name.compare(i, 3, "=3D") == 0) {
+            ret.push_back('=');
+            i += 2;
+        } else {
+            throw std::invalid_argument("SCRAM username has an invalid escape");
+        }
+    }
+    return ret;
+}
+
+} // namespace
+
+ScramCredentials ScramCredentials::derive(const std::string& password,
+        std::vector<uint8_t> salt, uint32_t iterations) {
+    Bytes saltedPassword(keyLength);
+    PKCS5_PBKDF2_HMAC(password.data(), password.size(), salt.data(), salt.size(),
+        iterations, EVP_sha256(), saltedPassword.size(), saltedPassword.data());
+
+    ScramCredentials ret;
+    ret.iterations = iterations;
+    ret.salt = std::move(salt);
+    ret.storedKey = sha256(hmac(saltedPassword, "Client Key"));
+    ret.serverKey = hmac(saltedPassword, "Server Key");
+    return ret;
+}
+
+ScramCredentials ScramCredentials::decode(const std::string& hashedPassword) {
+    if (hashedPassword.compare(0, SchemeName.size(), SchemeName) != 0)
+        throw std::invalid_argument("hashed password has invalid scheme");
+
+    std::vector<std::string> parts;
+    std::stringstream stream(hashedPassword.substr(SchemeName.size()));
+    std::string part;
+    while (std::getline(stream, part, '$')) {
+        parts.push_back(part);
+    }
+    if (parts.size() != 4 || parts[0].empty() || parts[0].size() > 9 ||
+            parts[0].find_first_not_of("0123456789") != std::string::npos)
+        throw std::invalid_argument("hashed password has invalid SCRAM credentials");
+
+    ScramCredentials ret;
+    ret.iterations = static_cast<uint32_t>(std::stoul(parts[0]));
+    ret.salt = base64Decode(parts[1]);
+    ret.storedKey = base64Decode(parts[2]);
+    ret.serverKey = base64Decode(parts[3]);
+    if (ret.iterations == 0 || ret.salt.empty() || ret.storedKey.size() != keyLength ||
+            ret.serverKey.size() != keyLength)
+        throw std::invalid_argument("hashed password has invalid SCRAM credentials");
+    return ret;
+}
+
+std::string ScramCredentials::encode() const {
+    std::stringstream strBuf;
+    strBuf << SchemeName << iterations << "$" << base64Encode(salt) << "$"
+        << base64Encode(storedKey) << "$" << base64Encode(serverKey);
+    return strBuf.str();
+}
+
+ScramScheme::ScramScheme(uint32_t iterations):
+    _iterations{iterations}
+{
+    if (iterations == 0)
+        throw std::invalid_argument("SCRAM iterations must be at least 1");
+}
+
+const std::string& ScramScheme::name() const {
+    return SchemeName;
+}
+
+std::string ScramScheme::hash(const std::string& password) const {
+    return ScramCredentials::derive(password, randomBytes(saltLength), _iterations).encode();
+}
+
+void ScramScheme::verify(const std::vector<PasswordCheck*>& checks) const {
+    for (auto check: checks) {
+        try {
+            auto stored = ScramCredentials::decode(check->hashedPassword);
+            auto derived = ScramCredentials::derive(check->password, stored.salt,
+                stored.iterations);
+            check->matched = constantTimeEquals(derived.storedKey, stored.storedKey);
+        } catch (const std::exception&) {
+            check->error = std::current_exception();
+        }
+    }
+}
+
+bool ScramScheme::outdated(const std::string& hashedPassword) const {
+    try {
+        return ScramCredentials::decode(hashedPassword).iterations < _iterations;
+    } catch (const std::exception&) {
+        return true;
+    }
+}
+
+ScramExchange::ScramExchange(const std::string& clientFirst):
+    _gs2Header{},
+    _clientFirstBare{},
+    _user{},
+    _nonce{},
+    _serverFirst{},
+    _credentials{},
+    _known{false}
+{
+    // gs2-header is the channel binding flag and an authzid, each followed by a comma.
+    auto flagEnd = clientFirst.find(',');
+    auto authzEnd = flagEnd == std::string::npos ?
+        std::string::npos : clientFirst.find(',', flagEnd + 1);
+    if (authzEnd == std::string::npos)
+        throw std::invalid_argument("SCRAM client-first-message is malformed");
+    auto flag = clientFirst.substr(0, flagEnd);
+    if (flag != "n" && flag != "y")
+        throw std::invalid_argument("SCRAM channel binding is not supported");
+    if (authzEnd != flagEnd + 1)
+        throw std::invalid_argument("SCRAM authorization identities are not supported");
+    _gs2Header = clientFirst.substr(0, authzEnd + 1);
+    _clientFirstBare = clientFirst.substr(authzEnd + 1);
+
+    auto fields = splitFields(_clientFirstBare);
+    if (fields.size() < 2)
+        throw std::invalid_argument("SCRAM client-first-message is malformed");
+    if (!fields[0].empty() && fields[0][0] == 'm')
+        throw std::invalid_argument("SCRAM mandatory extensions are not supported");
+    _user = unescapeName(fieldValue(fields[0], 'n'));
+    _nonce = fieldValue(fields[1], 'r');
+    if (_user.empty() || _nonce.empty())
+        throw std::invalid_argument("SCRAM client-first-message is malformed");
+}
+
+std::string ScramExchange::challenge(const std::string* credentials) {
+    if (credentials) {
+        _credentials = ScramCredentials::decode(*credentials);
+        _known = true;
+    } else {
+        auto scheme = std::dynamic_pointer_cast<const ScramScheme>(findScheme(SchemeName));
+        _credentials.iterations = scheme ? scheme->iterations() : 10000;
+        _credentials.salt = hmac(unknownUserKey(), _user);
+        _credentials.salt.resize(saltLength);
+        _credentials.storedKey = randomBytes(keyLength);
+        _credentials.serverKey = randomBytes(keyLength);
+        _known = false;
+    }
+
+    // Printable nonce characters, which base64 of random bytes without padding is.
+    _nonce += base64Encode(randomBytes(nonceLength));
+    std::stringstream strBuf;
+    strBuf << "r=" << _nonce << ",s=" << base64Encode(_credentials.salt)
+        << ",i=" << _credentials.iterations;
+    _serverFirst = strBuf.str();
+    return _serverFirst;
+}
+
+bool ScramExchange::finish(const std::string& clientFinal, std::string& serverFinal) {
+    auto proofPos = clientFinal.rfind(",p=");
+    if (_serverFirst.empty() || proofPos == std::string::npos)
+        throw std::invalid_argument("SCRAM client-final-message is malformed");
+    auto withoutProof = clientFinal.substr(0, proofPos);
+    auto proof = base64Decode(clientFinal.substr(proofPos + 3));
+
+    auto fields = splitFields(withoutProof);
+    if (fields.size() < 2)
+        throw std::invalid_argument("SCRAM client-final-message is malformed");
+    auto gs2Header = base64Decode(fieldValue(fields[0], 'c'));
+    if (std::string(gs2Header.begin(), gs2Header.end()) != _gs2Header)
+        throw std::invalid_argument("SCRAM channel binding doesn't match");
+    if (fieldValue(fields[1], 'r') != _nonce)
+        throw std::invalid_argument("SCRAM nonce doesn't match");
+
+    auto authMessage = _clientFirstBare + "," + _serverFirst + "," + withoutProof;
+    auto clientSignature = hmac(_credentials.storedKey, authMessage);
+    if (proof.size() != clientSignature.size())
+        return false;
+    Bytes clientKey(proof.size());
+    for (size_t i = 0; i < proof.size(); i++) {
+        clientKey[i] = proof[i] ^ clientSignature[i];
+    }
+    if (!constantTimeEquals(sha256(clientKey), _credentials.storedKey) || !_known)
+        return false;
+
+    serverFinal = "v=" + base64Encode(hmac(_credentials.serverKey, authMessage));
+    return true;
+}
+
+} // namespace Password
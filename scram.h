@@ -0,0 +1,80 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "passwords.h"
+
+namespace Password {
+
+// The SASL mechanism name for ScramExchange.
+extern const std::string ScramMechanism;
+
+// SCRAM-SHA-256 credentials (RFC 5802, RFC 7677), stored in userPassword as
+// {SCRAM-SHA-256}iterations$base64(salt)$base64(StoredKey)$base64(ServerKey).
+//
+// They can't be used to recover the password or to log in as the user, but they're enough
+// for the server to check a SCRAM proof with a handful of HMACs while the client does the
+// iterated hashing. Simple binds against them still work, at the cost of one PBKDF2-SHA256.
+struct ScramCredentials {
+    uint32_t iterations;
+    std::vector<uint8_t> salt;
+    std::vector<uint8_t> storedKey;
+    std::vector<uint8_t> serverKey;
+
+    static ScramCredentials derive(const std::string& password,
+        std::vector<uint8_t> salt, uint32_t iterations);
+    // Throws std::invalid_argument if hashedPassword isn't SCRAM-SHA-256 credentials.
+    static ScramCredentials decode(const std::string& hashedPassword);
+    std::string encode() const;
+};
+
+// Hashes made by this scheme are needed for SASL binds, so they're never swapped for the
+// preferred scheme's, only for SCRAM credentials with more iterations.
+class ScramScheme : public Scheme {
+public:
+    explicit ScramScheme(uint32_t iterations = 10000);
+
+    const std::string& name() const override;
+    std::string hash(const std::string& password) const override;
+    void verify(const std::vector<PasswordCheck*>& checks) const override;
+    bool outdated(const std::string& hashedPassword) const override;
+    bool replaceable() const override { return false; }
+
+    uint32_t iterations() const { return _iterations; }
+
+private:
+    const uint32_t _iterations;
+};
+
+// The server side of one SCRAM-SHA-256 exchange. Channel binding and authorization
+// identities aren't supported. Every method throws std::invalid_argument if the client's
+// message is malformed or asks for something we don't support.
+class ScramExchange {
+public:
+    // Parses the client-first-message.
+    explicit ScramExchange(const std::string& clientFirst);
+
+    // The SCRAM username, with its =2C and =3D escapes undone.
+    const std::string& user() const { return _user; }
+
+    // Returns the server-first-message. credentials is the user's stored SCRAM hash, or null
+    // if they don't have one, in which case the exchange carries on with made up credentials
+    // so it fails the same way a wrong password does.
+    std::string challenge(const std::string* credentials);
+    // Checks the client-final-message. Returns true and sets serverFinal if the client proved
+    // it knows the password.
+    bool finish(const std::string& clientFinal, std::string& serverFinal);
+
+private:
+    std::string _gs2Header;
+    std::string _clientFirstBare;
+    std::string _user;
+    std::string _nonce;
+    std::string _serverFirst;
+    ScramCredentials _credentials;
+    bool _known;
+};
+
+} // namespace Password
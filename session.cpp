@@ -0,0 +1,938 @@
+#include <pwd.h>
+
+#include <algorithm>
+#include <sstream>
+#include <utility>
+
+#include <boost/algorithm/string.hpp>
+
+#include "loguru.hpp"
+#include "exceptions.h"
+#include "metrics.h"
+#include "passwords.h"
+#include "scram.h"
+#include "session.h"
+
+namespace Server {
+
+namespace {
+
+// Searches with this base return the server's counters instead of going to the database.
+const std::string MonitorDN = "cn=monitor";
+
+Metrics::Counter abandonedOperations{"abandonedOperations"};
+Metrics::Counter pagedSearchesExpired{"pagedSearchesExpired"};
+Metrics::Counter passwordsRehashed{"passwordsRehashed"};
+Metrics::Counter scramBinds{"scramBinds"};
+Metrics::Counter externalBinds{"externalBinds"};
+Metrics::Counter outputWrites{"outputWrites"};
+
+// The most queued outputs one write hands the socket. asio won't pass more than 64 buffers
+// to a single writev anyway.
+const size_t maxWriteBuffers = 64;
+
+const std::string ExternalMechanism = "EXTERNAL";
+
+// Fills in externalDNTemplate for the process on the other end of an ldapi connection.
+std::string externalDN(const std::string& dnTemplate, const PeerCredentials& credentials) {
+    auto dn = boost::replace_all_copy(dnTemplate, "{uid}", std::to_string(credentials.uid));
+    boost::replace_all(dn, "{gid}", std::to_string(credentials.gid));
+    if (dn.find("{user}") != std::string::npos) {
+        struct passwd pwd;
+        struct passwd* result = nullptr;
+        std::vector<char> buf(16384);
+        getpwuid_r(credentials.uid, &pwd, buf.data(), buf.size(), &result);
+        if (!result) {
+            throw Ldap::Exception(Ldap::ErrorCode::invalidCredentials,
+                ("No user name for uid " + std::to_string(credentials.uid)).c_str());
+        }
+        boost::replace_all(dn, "{user}", result->pw_name);
+    }
+    return dn;
+}
+
+Ldap::Control pagedResultsControl(std::string cookie) {
+    Ldap::PagedResults::Value value(0, std::move(cookie));
+    return Ldap::Control{Ldap::PagedResults::Oid, false, value.encode()};
+}
+
+} // namespace
+
+Session::Session(asio::io_service& ioService, asio::io_service& operationService,
+        asio::generic::stream_protocol::socket sock, std::string peer,
+        PeerCredentials peerCredentials, const SessionOptions& options,
+        Storage::Mongo::MongoBackend& db):
+    _operationService(operationService),
+    _sock{std::move(sock)},
+    _strand{ioService},
+    _options(options),
+    _peer{std::move(peer)},
+    _peerCredentials(peerCredentials),
+    _framer{},
+    _db(db),
+    _pending{},
+    _running{},
+    _inFlight{0},
+    _bindInFlight{false},
+    _reading{false},
+    _peerClosed{false},
+    _closing{false},
+    _outputLock{},
+    _writeQueue{},
+    _writeQueueBytes{0},
+    _writing{0},
+    _flushPosted{false},
+    _writeFailed{false},
+    _parkedSearches{},
+    _abandoned{},
+    _pagingLock{},
+    _pagedSearches{},
+    _nextPagedSearch{0},
+    _userBound{false},
+    _userBoundDN{},
+    _scram{}
+{}
+
+void Session::start() {
+    LOG_S(INFO) << "Accepted connection from " << _peer;
+    // Reads are only issued once the socket is readable, so they must never block an
+    // io thread.
+    _sock.non_blocking(true);
+    waitReadable();
+}
+
+void Session::waitReadable() {
+    if (_closing || _reading || _peerClosed)
+        return;
+    // Don't hang on to a read buffer while we wait on an idle connection.
+    _framer.release();
+
+    _reading = true;
+    auto self = shared_from_this();
+    _sock.async_wait(asio::socket_base::wait_read, _strand.wrap(
+        [self](const asio::error_code& error) {
+            self->onReadable(error);
+        }));
+}
+
+void Session::onReadable(const asio::error_code& error) {
+    _reading = false;
+    if (error) {
+        if (error != asio::error::operation_aborted) {
+            LOG_S(ERROR) << "Error waiting on " << _peer << ": " << error.message();
+        }
+        _closing = true;
+        maybeClose();
+        return;
+    }
+
+    asio::error_code readError;
+    auto readBuffer = _framer.prepare();
+    auto length = _sock.read_some(asio::buffer(readBuffer.first, readBuffer.second), readError);
+    if (readError == asio::error::would_block || readError == asio::error::try_again) {
+        waitReadable();
+        return;
+    } else if (readError) {
+        if (readError != asio::error::eof) {
+            LOG_S(ERROR) << "Error reading from " << _peer << ": " << readError.message();
+        }
+        // Let whatever the client already sent finish before closing.
+        _peerClosed = true;
+        processMessages();
+        return;
+    }
+
+    _framer.commit(length);
+    processMessages();
+}
+
+void Session::processMessages() {
+    bool exhausted = false;
+    while (!_closing && _pending.size() < _options.maxInFlight) {
+        Ber::PacketView message;
+        try {
+            if (!_framer.next(message)) {
+                exhausted = true;
+                break;
+            }
+        } catch (const Ldap::Exception& e) {
+            LOG_S(ERROR) << "Error framing message from " << _peer << ": " << e.what();
+            _closing = true;
+            _pending.clear();
+            break;
+        }
+
+        if (!queueMessage(message)) {
+            _closing = true;
+        }
+    }
+
+    dispatchPending();
+    if (exhausted && _peerClosed)
+        _closing = true;
+    if (_closing) {
+        maybeClose();
+        return;
+    }
+    // If we stopped because too many requests are outstanding, reading picks back up as
+    // they finish.
+    if (exhausted)
+        waitReadable();
+}
+
+bool Session::queueMessage(const Ber::PacketView& message) {
+    auto berIt = message.begin();
+    if (berIt == message.end()) {
+        LOG_F(ERROR, "Client sent an empty LDAP message");
+        return false;
+    }
+    auto messageId = static_cast<uint64_t>(*berIt);
+    ++berIt;
+    if (berIt == message.end()) {
+        LOG_F(ERROR, "Client sent an LDAP message without a protocol operation");
+        return false;
+    }
+
+    auto op = std::make_shared<Operation>();
+    op->messageId = messageId;
+    op->type = static_cast<Ldap::MessageTag>(berIt->tag);
+    op->hasControls = false;
+    op->fatal = false;
+    op->abandoned = false;
+    if (op->type == Ldap::MessageTag::UnbindRequest)
+        return false;
+    // Abandons get no response, so there's no need to queue them up behind other requests.
+    if (op->type == Ldap::MessageTag::AbandonRequest) {
+        abandon(static_cast<uint64_t>(*berIt));
+        return true;
+    }
+
+    // Copy the message out of the framer and point the protocol op at our copy.
+    op->message.assign(message.dataBegin, message.dataEnd);
+    auto copy = Ber::PacketView::decode(message.tag |
+        static_cast<uint8_t>(message.type) | static_cast<uint8_t>(message.berClass),
+        op->message);
+    auto copyIt = copy.begin();
+    ++copyIt;
+    op->protocolOp = *copyIt;
+    // Controls are parsed by whoever runs the operation, so a bad one fails just that request.
+    if (++copyIt != copy.end()) {
+        op->controls = *copyIt;
+        op->hasControls = true;
+    }
+    _pending.push_back(op);
+    return true;
+}
+
+void Session::dispatchPending() {
+    while (!_pending.empty() && !_bindInFlight) {
+        auto op = _pending.front();
+        auto isBind = (op->type == Ldap::MessageTag::BindRequest);
+        if (isBind ? _inFlight > 0 : _inFlight >= _options.maxInFlight)
+            break;
+
+        _pending.pop_front();
+        _running[op->messageId] = op;
+        _inFlight++;
+        _bindInFlight = isBind;
+        auto self = shared_from_this();
+        _operationService.post([self, op]() {
+            self->runOperation(op);
+        });
+    }
+}
+
+void Session::abandon(uint64_t messageId) {
+    abandonedOperations.add();
+    auto pendingIt = std::find_if(_pending.begin(), _pending.end(),
+        [messageId](const OperationPtr& op) {
+            return op->messageId == messageId;
+        });
+    // Binds can't be abandoned, whether they've started or not.
+    if (pendingIt != _pending.end()) {
+        if ((*pendingIt)->type != Ldap::MessageTag::BindRequest)
+            _pending.erase(pendingIt);
+        return;
+    }
+
+    auto runningIt = _running.find(messageId);
+    if (runningIt == _running.end() ||
+            runningIt->second->type == Ldap::MessageTag::BindRequest)
+        return;
+
+    auto op = runningIt->second;
+    op->abandoned = true;
+    OperationPtr parked;
+    {
+        std::lock_guard<std::mutex> guard(_outputLock);
+        _abandoned.insert(messageId);
+
+        // Throw away everything that's still queued, except buffers that are already
+        // part-way out the door.
+        auto it = _writeQueue.begin() + std::min(_writing, _writeQueue.size());
+        while (it != _writeQueue.end()) {
+            if (it->messageId == messageId) {
+                _writeQueueBytes -= it->bytes.size();
+                it = _writeQueue.erase(it);
+            } else {
+                ++it;
+            }
+        }
+
+        auto parkedIt = std::find(_parkedSearches.begin(), _parkedSearches.end(), op);
+        if (parkedIt != _parkedSearches.end()) {
+            parked = *parkedIt;
+            _parkedSearches.erase(parkedIt);
+        }
+    }
+
+    // A parked search isn't running anywhere, so wake it up to notice it's been abandoned.
+    if (parked) {
+        auto self = shared_from_this();
+        _operationService.post([self, parked]() {
+            self->resumeSearch(parked);
+        });
+    }
+}
+
+void Session::onOperationDone(OperationPtr op) {
+    _running.erase(op->messageId);
+    if (op->abandoned) {
+        std::lock_guard<std::mutex> guard(_outputLock);
+        _abandoned.erase(op->messageId);
+    }
+    _inFlight--;
+    if (op->type == Ldap::MessageTag::BindRequest)
+        _bindInFlight = false;
+    if (op->fatal) {
+        _closing = true;
+        _pending.clear();
+    }
+    processMessages();
+}
+
+void Session::runOperation(OperationPtr op) {
+    Ldap::MessageTag errorResponseType;
+    switch (op->type) {
+    case Ldap::MessageTag::SearchRequest:
+        errorResponseType = Ldap::MessageTag::SearchResDone;
+        break;
+    default:
+        errorResponseType = static_cast<Ldap::MessageTag>(static_cast<uint8_t>(op->type) + 1);
+        break;
+    }
+
+    bool finished = true;
+    try {
+        std::vector<Ldap::Control> controls;
+        if (op->hasControls)
+            controls = Ldap::parseControls(op->controls);
+        for (const auto& control: controls) {
+            auto supported = (op->type == Ldap::MessageTag::SearchRequest &&
+                control.oid == Ldap::PagedResults::Oid);
+            if (control.critical && !supported) {
+                throw Ldap::Exception(Ldap::ErrorCode::unavailableCriticalExtension,
+                    ("Unsupported critical control " + control.oid).c_str());
+            }
+        }
+
+        switch (op->type) {
+        case Ldap::MessageTag::BindRequest:
+            finished = handleBind(op);
+            break;
+        case Ldap::MessageTag::SearchRequest:
+            finished = handleSearch(op, controls);
+            break;
+        case Ldap::MessageTag::AddRequest:
+            handleAdd(op->messageId, op->protocolOp, op->arena);
+            break;
+        case Ldap::MessageTag::ModifyRequest:
+            handleModify(op->messageId, op->protocolOp, op->arena);
+            break;
+        case Ldap::MessageTag::DelRequest:
+            handleDelete(op->messageId, op->protocolOp);
+            break;
+        default:
+            break;
+        }
+    } catch (const Ldap::Exception& e) {
+        auto resPacket = Ldap::buildLdapResult(e, "", e.what(), errorResponseType);
+        sendResponse(op->messageId, std::move(resPacket));
+        // Other requests on this connection can carry on after an error, unless the
+        // client is sending us garbage.
+        op->fatal = (e == Ldap::ErrorCode::protocolError);
+    } catch (const std::exception& e) {
+        auto resPacket = Ldap::buildLdapResult(Ldap::ErrorCode::other,
+            "", e.what(), errorResponseType);
+        sendResponse(op->messageId, std::move(resPacket));
+    } catch (...) {
+        auto resPacket = Ldap::buildLdapResult(Ldap::ErrorCode::other,
+            "", "Unknown error occurred", errorResponseType);
+        sendResponse(op->messageId, std::move(resPacket));
+    }
+
+    if (finished)
+        finishOperation(op);
+}
+
+void Session::finishOperation(OperationPtr op) {
+    auto self = shared_from_this();
+    _strand.post([self, op]() {
+        self->onOperationDone(op);
+    });
+}
+
+bool Session::handleBind(OperationPtr op) {
+    Ldap::Bind::Request bindReq(op->protocolOp);
+    if (bindReq.type == Ldap::Bind::Request::Type::Sasl) {
+        handleSaslBind(op->messageId, bindReq);
+        return true;
+    }
+    // Any other bind abandons a SASL exchange that's in progress.
+    _scram.reset();
+
+    if (_options.noAuthentication) {
+        LOG_S(INFO)
+            << "Authentication is disabled, sending bogus bind for "
+            << bindReq.dn;
+        completeBind(op->messageId, bindReq.dn, true);
+        return true;
+    }
+
+    LOG_S(INFO) << "Authenticating " << bindReq.dn << " from " << _peer;
+    std::shared_ptr<Ldap::Entry> entry;
+    try {
+        entry = _db.findEntry(bindReq.dn);
+    } catch (const Ldap::Exception& e) {
+        LOG_S(ERROR) << "Error during authentication " << e.what();
+        if (e == Ldap::ErrorCode::noSuchObject) {
+            throw Ldap::Exception(Ldap::ErrorCode::invalidCredentials);
+        }
+        throw;
+    }
+    auto passwordIt = entry->attributes.find("userPassword");
+    if (passwordIt == entry->attributes.end()) {
+        LOG_S(INFO) << bindReq.dn << " has no userPassword, rejecting the bind";
+        throw Ldap::Exception(Ldap::ErrorCode::invalidCredentials);
+    }
+    const auto& hashes = passwordIt->second;
+
+    auto bindCache = _options.bindCache;
+    if (bindCache) {
+        for (const auto& pass: hashes) {
+            if (bindCache->verified(bindReq.dn, pass, bindReq.simple)) {
+                completeBind(op->messageId, bindReq.dn, true);
+                return true;
+            }
+        }
+    }
+
+    if (_options.hashPool == nullptr) {
+        auto matched = checkPasswords(bindReq.simple, hashes);
+        if (matched >= 0)
+            passwordVerified(entry, matched, bindReq.simple);
+        completeBind(op->messageId, bindReq.dn, matched >= 0);
+        return true;
+    }
+
+    auto self = shared_from_this();
+    auto dn = bindReq.dn;
+    auto password = bindReq.simple;
+    Password::VerifyRequest request;
+    request.password = password;
+    request.hashes = hashes;
+    // The hash thread only hands the result back. Rehashing talks to mongo, so it and the
+    // rest of the bind run on an operation thread.
+    request.done = [self, op, entry, dn, password](int matched, std::exception_ptr error) {
+        self->_operationService.post([self, op, entry, dn, password, matched, error]() {
+            try {
+                if (error)
+                    std::rethrow_exception(error);
+                if (matched >= 0)
+                    self->passwordVerified(entry, matched, password);
+                self->completeBind(op->messageId, dn, matched >= 0);
+            } catch (const std::exception& e) {
+                self->sendResponse(op->messageId, Ldap::buildLdapResult(
+                    Ldap::ErrorCode::other, "", e.what(), Ldap::MessageTag::BindResponse));
+            }
+            self->finishOperation(op);
+        });
+    };
+    auto submitted = _options.hashPool->submit(std::move(request));
+    if (!submitted) {
+        LOG_S(WARNING) << "Too many binds waiting to be checked, rejecting " << bindReq.dn;
+        throw Ldap::Exception(Ldap::ErrorCode::busy);
+    }
+    return false;
+}
+
+int Session::checkPasswords(const std::string& password,
+        const std::vector<std::string>& hashes) {
+    for (size_t i = 0; i < hashes.size(); i++) {
+        if (Password::checkPassword(password, hashes[i]))
+            return static_cast<int>(i);
+    }
+    return -1;
+}
+
+void Session::passwordVerified(std::shared_ptr<Ldap::Entry> entry, int matched,
+        const std::string& password) {
+    auto hash = entry->attributes.at("userPassword")[matched];
+    if (_options.rehashPasswords && Password::needsRehash(hash)) {
+        // The bind has already succeeded, so a failure here only means we try again
+        // next time.
+        try {
+            auto oldScheme = Password::findScheme(hash);
+            auto newHash = Password::rehash(hash, password);
+            // The entry was read before the password was checked, so swap just this one
+            // value and only if it's still there. Anything else could undo a modify, a
+            // password reset or a delete that happened in between.
+            using ModType = Ldap::Modify::Modification::Type;
+            Memory::ArenaVector<Ldap::Modify::Modification> mods(2);
+            mods[0].type = ModType::Delete;
+            mods[0].name = "userPassword";
+            mods[0].values.push_back(hash);
+            mods[1].type = ModType::Add;
+            mods[1].name = "userPassword";
+            mods[1].values.push_back(newHash);
+            _db.modifyEntry(entry->dn, mods);
+            passwordsRehashed.add();
+            LOG_S(INFO) << "Rehashed password for " << entry->dn << " from "
+                << (oldScheme ? oldScheme->name() : "unknown scheme") << " to "
+                << Password::findScheme(newHash)->name();
+            hash = std::move(newHash);
+        } catch (const Ldap::Exception& e) {
+            if (e == Ldap::ErrorCode::noSuchAttribute || e == Ldap::ErrorCode::noSuchObject) {
+                LOG_S(INFO) << "Not rehashing password for " << entry->dn
+                    << ", it changed while the bind was being checked";
+            } else {
+                LOG_S(ERROR) << "Error rehashing password for " << entry->dn << ": "
+                    << e.what();
+            }
+            return;
+        } catch (const std::exception& e) {
+            LOG_S(ERROR) << "Error rehashing password for " << entry->dn << ": " << e.what();
+            return;
+        }
+    }
+    if (_options.bindCache)
+        _options.bindCache->remember(entry->dn, hash, password);
+}
+
+void Session::handleSaslBind(uint64_t messageId, const Ldap::Bind::Request& bindReq) {
+    if (bindReq.saslMech == ExternalMechanism) {
+        _scram.reset();
+        handleExternalBind(messageId, bindReq);
+        return;
+    }
+    if (bindReq.saslMech != Password::ScramMechanism) {
+        _scram.reset();
+        throw Ldap::Exception(Ldap::ErrorCode::authMethodNotSupported,
+            ("Unsupported SASL mechanism " + bindReq.saslMech).c_str());
+    }
+
+    std::string message(bindReq.saslCredentials.begin(), bindReq.saslCredentials.end());
+    // Take the exchange out, so it's over whatever happens unless we put it back.
+    std::unique_ptr<Password::ScramExchange> scram(std::move(_scram));
+    try {
+        // A client-final-message always starts with the channel binding. Anything else
+        // starts a new exchange.
+        if (scram && message.compare(0, 2, "c=") == 0) {
+            std::string serverFinal;
+            auto passOkay = scram->finish(message, serverFinal);
+            scramBinds.add();
+            LOG_S(INFO) << "SCRAM bind for " << scram->user() << " from " << _peer
+                << (passOkay ? " succeeded" : " failed");
+            completeBind(messageId, scram->user(), passOkay,
+                std::vector<uint8_t>(serverFinal.begin(), serverFinal.end()));
+            return;
+        }
+
+        if (message.compare(0, 2, "c=") == 0)
+            throw std::invalid_argument("SCRAM client-final-message without an exchange");
+        scram.reset(new Password::ScramExchange(message));
+        // SCRAM usernames are the bind DN. An entry without SCRAM credentials gets a
+        // challenge anyway, so the client can't tell whether it exists.
+        std::string credentials;
+        try {
+            auto entry = _db.findEntry(scram->user());
+            auto passwords = entry->attributes.find("userPassword");
+            if (passwords != entry->attributes.end()) {
+                for (const auto& hash: passwords->second) {
+                    if (std::dynamic_pointer_cast<const Password::ScramScheme>(
+                            Password::findScheme(hash))) {
+                        credentials = hash;
+                        break;
+                    }
+                }
+            }
+        } catch (const Ldap::Exception& e) {
+            if (e != Ldap::ErrorCode::noSuchObject)
+                throw;
+        }
+        auto serverFirst = scram->challenge(credentials.empty() ? nullptr : &credentials);
+
+        Ldap::Bind::Response bindResp(Ldap::buildLdapResult(
+            Ldap::ErrorCode::saslBindInProgress, "", "", Ldap::MessageTag::BindResponse));
+        bindResp.appendSaslResponse(
+            std::vector<uint8_t>(serverFirst.begin(), serverFirst.end()));
+        _scram = std::move(scram);
+        sendResponse(messageId, std::move(bindResp.response));
+    } catch (const std::invalid_argument& e) {
+        LOG_S(WARNING) << "Bad SCRAM message from " << _peer << ": " << e.what();
+        throw Ldap::Exception(Ldap::ErrorCode::invalidCredentials, e.what());
+    }
+}
+
+void Session::handleExternalBind(uint64_t messageId, const Ldap::Bind::Request& bindReq) {
+    if (!_peerCredentials.known) {
+        throw Ldap::Exception(Ldap::ErrorCode::inappropriateAuthentication,
+            "SASL EXTERNAL is only available over ldapi");
+    }
+
+    auto dn = externalDN(_options.externalDNTemplate, _peerCredentials);
+    // Clients may name the identity they expect to get, but can't ask for another one.
+    std::string authzId(bindReq.saslCredentials.begin(), bindReq.saslCredentials.end());
+    if (!authzId.empty() && !boost::iequals(authzId, "dn:" + dn)) {
+        LOG_S(WARNING) << "SASL EXTERNAL bind from " << _peer << " asked for " << authzId
+            << " but is " << dn;
+        throw Ldap::Exception(Ldap::ErrorCode::invalidCredentials);
+    }
+
+    LOG_S(INFO) << "SASL EXTERNAL bind from " << _peer << " as " << dn;
+    externalBinds.add();
+    completeBind(messageId, dn, true);
+}
+
+void Session::completeBind(uint64_t messageId, const std::string& dn, bool passOkay,
+        std::vector<uint8_t> serverSaslCreds) {
+    Ldap::ErrorCode respCode;
+    if (passOkay) {
+        respCode = Ldap::ErrorCode::success;
+        _userBound = true;
+        _userBoundDN = dn;
+    } else {
+        respCode = Ldap::ErrorCode::invalidCredentials;
+        _userBound = false;
+        _userBoundDN = "";
+    }
+
+    if (dn.empty() && serverSaslCreds.empty()) {
+        sendResult(messageId, respCode, Ldap::MessageTag::BindResponse);
+        return;
+    }
+    Ldap::Bind::Response bindResp(Ldap::buildLdapResult(respCode, dn, "",
+                Ldap::MessageTag::BindResponse));
+    if (!serverSaslCreds.empty())
+        bindResp.appendSaslResponse(std::move(serverSaslCreds));
+    sendResponse(messageId, std::move(bindResp.response));
+}
+
+bool Session::handleSearch(OperationPtr op, const std::vector<Ldap::Control>& controls) {
+    Ldap::Search::Request searchReq(op->protocolOp, &op->arena);
+    if (boost::iequals(searchReq.base, MonitorDN)) {
+        handleMonitorSearch(op->messageId);
+        return true;
+    }
+
+    auto pagedControl = std::find_if(controls.begin(), controls.end(),
+        [](const Ldap::Control& control) {
+            return control.oid == Ldap::PagedResults::Oid;
+        });
+    if (pagedControl == controls.end()) {
+        op->search.reset(new SearchState(_db.findEntries(searchReq), 0,
+            Storage::Mongo::ResultOptions(searchReq)));
+    } else {
+        Ldap::PagedResults::Value paging(pagedControl->value);
+        Storage::Mongo::SearchPage page{"", paging.size};
+        if (!paging.cookie.empty()) {
+            page.afterId = takePagedSearch(paging.cookie, *op);
+        }
+        // A page size of zero tells us the client is done with this paged search.
+        if (paging.size == 0) {
+            sendResponse(op->messageId,
+                Ldap::buildLdapResult(Ldap::ErrorCode::success,
+                    "", "", Ldap::MessageTag::SearchResDone),
+                { pagedResultsControl("") });
+            return true;
+        }
+        op->search.reset(new SearchState(_db.findEntries(searchReq, &page), paging.size,
+            Storage::Mongo::ResultOptions(searchReq)));
+    }
+    if (!pumpSearch(op))
+        return false;
+    op->search.reset();
+    return true;
+}
+
+void Session::handleMonitorSearch(uint64_t messageId) {
+    Ldap::Entry monitor(MonitorDN);
+    monitor.appendValue("objectClass", "monitorServer");
+    for (const auto& counter: Metrics::snapshot()) {
+        monitor.appendValue(counter.first, std::to_string(counter.second));
+    }
+
+    sendResponse(messageId, Ldap::Search::generateResult(monitor));
+    sendResult(messageId, Ldap::ErrorCode::success, Ldap::MessageTag::SearchResDone);
+}
+
+bool Session::pumpSearch(OperationPtr op) {
+    auto& search = *op->search;
+    auto paged = (search.pageSize > 0);
+    try {
+        while (search.it != search.end && !(paged && search.sent == search.pageSize)) {
+            // Stop without a SearchResDone, resumeSearch will release the cursor.
+            if (op->abandoned)
+                return true;
+            {
+                std::lock_guard<std::mutex> guard(_outputLock);
+                if (_writeFailed)
+                    return true;
+                // onWrite will resume us once the socket has drained.
+                if (_writeQueueBytes >= _options.outputHighWater) {
+                    _parkedSearches.push_back(op);
+                    return false;
+                }
+            }
+            search.it.encodeResult(op->messageId, search.result, search.batch);
+            if (paged)
+                search.lastId = search.it.id();
+            search.sent++;
+            // Also send what we have before the cursor goes back to mongo for more, so the
+            // client isn't kept waiting on the round trip.
+            if (search.batch.size() >= _options.searchBatchBytes ||
+                    search.sent % Storage::Mongo::cursorBatchSize == 0)
+                queueSearchBatch(*op);
+            ++search.it;
+        }
+        queueSearchBatch(*op);
+
+        std::vector<Ldap::Control> controls;
+        if (paged) {
+            // findEntries fetched one more entry than the page size, so if we stopped short
+            // of the end there's another page.
+            std::string cookie;
+            if (search.it != search.end)
+                cookie = savePagedSearch(*op, search.lastId);
+            controls.push_back(pagedResultsControl(std::move(cookie)));
+        }
+        if (controls.empty()) {
+            sendResult(op->messageId, Ldap::ErrorCode::success,
+                Ldap::MessageTag::SearchResDone);
+        } else {
+            sendResponse(op->messageId,
+                Ldap::buildLdapResult(Ldap::ErrorCode::success,
+                    "", "", Ldap::MessageTag::SearchResDone),
+                controls);
+        }
+    } catch (const Ldap::Exception& e) {
+        queueSearchBatch(*op);
+        sendResponse(op->messageId, Ldap::buildLdapResult(e, "", e.what(),
+            Ldap::MessageTag::SearchResDone));
+    } catch (const std::exception& e) {
+        queueSearchBatch(*op);
+        sendResponse(op->messageId, Ldap::buildLdapResult(Ldap::ErrorCode::other,
+            "", e.what(), Ldap::MessageTag::SearchResDone));
+    }
+    return true;
+}
+
+void Session::queueSearchBatch(const Operation& op) {
+    auto& batch = op.search->batch;
+    if (batch.empty())
+        return;
+    queueOutput(op.messageId, std::move(batch));
+    batch.clear();
+}
+
+void Session::resumeSearch(OperationPtr op) {
+    if (pumpSearch(op)) {
+        // Dropping the cursor kills it on the server if it wasn't exhausted.
+        op->search.reset();
+        finishOperation(op);
+    }
+}
+
+std::string Session::savePagedSearch(const Operation& op, std::string lastId) {
+    auto now = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> guard(_pagingLock);
+    // Every cookie lives just as long, so the lowest numbered ones are the oldest.
+    while (!_pagedSearches.empty() && (_pagedSearches.begin()->second.expires < now ||
+            _pagedSearches.size() >= _options.maxPagedSearches)) {
+        pagedSearchesExpired.add();
+        _pagedSearches.erase(_pagedSearches.begin());
+    }
+
+    auto id = ++_nextPagedSearch;
+    _pagedSearches[id] = PagedSearch{std::move(lastId),
+        Ber::ByteVector(op.protocolOp.dataBegin, op.protocolOp.dataEnd),
+        now + _options.pagedSearchTimeout};
+    return std::to_string(id);
+}
+
+std::string Session::takePagedSearch(const std::string& cookie, const Operation& op) {
+    uint64_t id = 0;
+    try {
+        id = std::stoull(cookie);
+    } catch (const std::exception&) {
+    }
+
+    std::lock_guard<std::mutex> guard(_pagingLock);
+    auto it = _pagedSearches.find(id);
+    if (it == _pagedSearches.end() || it->second.expires < std::chrono::steady_clock::now() ||
+            Ber::ByteVector(op.protocolOp.dataBegin, op.protocolOp.dataEnd) !=
+                it->second.request) {
+        throw Ldap::Exception(Ldap::ErrorCode::unwillingToPerform,
+            "Invalid or expired paged results cookie");
+    }
+    auto afterId = std::move(it->second.afterId);
+    _pagedSearches.erase(it);
+    return afterId;
+}
+
+void Session::handleAdd(uint64_t messageId, const Ber::PacketView& protocolOp,
+        Memory::Arena& arena) {
+    Ldap::Entry entry = Ldap::Add::parseRequest(protocolOp, &arena);
+    _db.saveEntry(entry, true);
+    sendResult(messageId, Ldap::ErrorCode::success, Ldap::MessageTag::AddResponse);
+}
+
+void Session::handleModify(uint64_t messageId, const Ber::PacketView& protocolOp,
+        Memory::Arena& arena) {
+    Ldap::Modify::Request req(protocolOp, &arena);
+    _db.modifyEntry(req.dn, req.mods);
+    if (_options.bindCache) {
+        auto passwordChanged = std::any_of(req.mods.begin(), req.mods.end(),
+            [](const Ldap::Modify::Modification& mod) {
+                return boost::iequals(mod.name, "userPassword");
+            });
+        if (passwordChanged)
+            _options.bindCache->invalidate(req.dn);
+    }
+    sendResult(messageId, Ldap::ErrorCode::success, Ldap::MessageTag::ModifyResponse);
+}
+
+void Session::handleDelete(uint64_t messageId, const Ber::PacketView& protocolOp) {
+    std::string dn = Ldap::Delete::parseRequest(protocolOp);
+    _db.deleteEntry(dn);
+    sendResult(messageId, Ldap::ErrorCode::success, Ldap::MessageTag::DelResponse);
+}
+
+void Session::sendResponse(uint64_t messageId, Ber::Packet response,
+        const std::vector<Ldap::Control>& controls) {
+    Ber::Packet envelope(
+        Ber::Type::Constructed, Ber::Class::Universal, Ber::Tag::Sequence);
+    envelope.reserveChildren(3);
+    envelope.emplaceChild(Ber::Tag::Integer, messageId);
+    envelope.appendChild(std::move(response));
+    if (!controls.empty())
+        envelope.appendChild(Ldap::buildControls(controls));
+
+    Ber::ByteVector bytes;
+    envelope.copyBytes(bytes);
+    queueOutput(messageId, std::move(bytes));
+}
+
+void Session::sendResult(uint64_t messageId, Ldap::ErrorCode code, Ldap::MessageTag tag) {
+    queueOutput(messageId, Ldap::encodeLdapResult(messageId, code, tag));
+}
+
+void Session::queueOutput(uint64_t messageId, Ber::ByteVector bytes) {
+    std::lock_guard<std::mutex> guard(_outputLock);
+    if (_writeFailed || _abandoned.count(messageId) > 0)
+        return;
+    _writeQueueBytes += bytes.size();
+    _writeQueue.push_back(Output{messageId, std::move(bytes)});
+    // The socket may only be touched from the strand, so hand the write off to it.
+    if (!_writing && !_flushPosted) {
+        _flushPosted = true;
+        auto self = shared_from_this();
+        _strand.post([self]() {
+            self->flushOutput();
+        });
+    }
+}
+
+void Session::flushOutput() {
+    std::lock_guard<std::mutex> guard(_outputLock);
+    _flushPosted = false;
+    if (!_writing && !_writeQueue.empty())
+        startWrite();
+}
+
+void Session::startWrite() {
+    // Everything queued goes out in one gathered write, so a stream of small responses
+    // doesn't cost a syscall each.
+    std::vector<asio::const_buffer> buffers;
+    for (const auto& output: _writeQueue) {
+        if (buffers.size() == maxWriteBuffers)
+            break;
+        buffers.push_back(asio::buffer(output.bytes));
+    }
+    _writing = buffers.size();
+    outputWrites.add();
+
+    auto self = shared_from_this();
+    // Queueing more responses or dropping abandoned ones behind these can move the Outputs
+    // around in the deque, but never the vectors' data the buffers point at.
+    asio::async_write(_sock, buffers, _strand.wrap(
+        [self](const asio::error_code& error, size_t) {
+            self->onWrite(error);
+        }));
+}
+
+void Session::onWrite(const asio::error_code& error) {
+    std::deque<OperationPtr> resume;
+    {
+        std::lock_guard<std::mutex> guard(_outputLock);
+        auto written = _writing;
+        _writing = 0;
+        if (error) {
+            LOG_S(ERROR) << "Error writing to " << _peer << ": " << error.message();
+            _writeFailed = true;
+            _writeQueue.clear();
+            _writeQueueBytes = 0;
+            resume.swap(_parkedSearches);
+        } else {
+            for (; written > 0; written--) {
+                _writeQueueBytes -= _writeQueue.front().bytes.size();
+                _writeQueue.pop_front();
+            }
+            if (!_writeQueue.empty())
+                startWrite();
+            if (_writeQueueBytes < _options.outputHighWater / 2)
+                resume.swap(_parkedSearches);
+        }
+    }
+
+    auto self = shared_from_this();
+    for (auto& op: resume) {
+        _operationService.post([self, op]() {
+            self->resumeSearch(op);
+        });
+    }
+
+    if (error) {
+        _closing = true;
+        _pending.clear();
+        asio::error_code ignored;
+        _sock.close(ignored);
+    }
+    maybeClose();
+}
+
+void Session::maybeClose() {
+    if (!_closing || _inFlight > 0 || !_pending.empty() || !_sock.is_open())
+        return;
+    {
+        std::lock_guard<std::mutex> guard(_outputLock);
+        if (_writing || _flushPosted || !_writeQueue.empty())
+            return;
+    }
+
+    asio::error_code ignored;
+    _sock.shutdown(asio::socket_base::shutdown_both, ignored);
+    _sock.close(ignored);
+}
+
+} // namespace Server
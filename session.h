@@ -0,0 +1,256 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <asio.hpp>
+
+#include "arena.h"
+#include "ber.h"
+#include "bindcache.h"
+#include "hashpool.h"
+#include "framer.h"
+#include "ldapproto.h"
+#include "scram.h"
+#include "storage.h"
+
+namespace Server {
+
+struct SessionOptions {
+    bool noAuthentication = false;
+    // Searches stop encoding results once this many bytes are waiting to be written, and
+    // pick up again once the socket has drained below half of it.
+    size_t outputHighWater = 256 * 1024;
+    // Search results are gathered into buffers of about this size before they're queued,
+    // so each write to the socket carries many of them.
+    size_t searchBatchBytes = 64 * 1024;
+    // How many requests from one connection may be running at once. Once this many are
+    // running or waiting to run, the session stops reading from the socket.
+    size_t maxInFlight = 8;
+    // How long a paged results cookie stays valid after the page it came with, and how many
+    // of them one connection may hold at once. Past that, the oldest are forgotten.
+    std::chrono::seconds pagedSearchTimeout{300};
+    size_t maxPagedSearches = 16;
+    // Shared by every session and owned by whoever made the options. Null if simple binds
+    // should always check the password hash.
+    Password::BindCache* bindCache = nullptr;
+    // Where simple binds check password hashes. Also shared and not owned. Null to check
+    // them on the operation thread that's running the bind.
+    Password::HashPool* hashPool = nullptr;
+    // Whether a successful simple bind against a hash that needs upgrading (see
+    // Password::needsRehash) writes back a new hash made with the preferred scheme.
+    bool rehashPasswords = true;
+    // The DN a SASL EXTERNAL bind over the ldapi socket binds as. {uid} and {gid} are
+    // replaced with the peer's numeric ids and {user} with the name of its uid.
+    std::string externalDNTemplate =
+        "gidNumber={gid}+uidNumber={uid},cn=peercred,cn=external,cn=auth";
+};
+
+// The process on the other end of a Unix domain socket, from SO_PEERCRED. TCP connections
+// don't have any.
+struct PeerCredentials {
+    bool known = false;
+    uint32_t pid = 0;
+    uint32_t uid = 0;
+    uint32_t gid = 0;
+};
+
+// Session holds all of the state for one client connection.
+//
+// Reading, framing and dispatching requests all happen on the session's strand. Each request
+// is copied out of the read buffer into an Operation, which runs on whichever operation
+// thread picks it up, so one slow search doesn't hold up binds and lookups queued behind it
+// on the same connection. Responses are tagged with their messageId and go through one output
+// queue, so responses to different requests may interleave but are never torn.
+//
+// Operations block on mongo, so they run on threads of their own rather than the io threads.
+// A connection with slow searches in flight can use up operation threads, but the io threads
+// only ever do socket work that can't block, so other connections' reads and writes go on.
+//
+// Binds run by themselves: they wait for everything before them to finish, and nothing after
+// them starts until they're done. The password check itself runs on the HashPool, so a bind
+// only holds up its own connection while it waits there. The result comes back to an
+// operation thread, which finishes the bind.
+//
+// An AbandonRequest is handled as soon as it's read. A request that hasn't started yet is
+// dropped, a running search stops at the next entry and releases its cursor, and any output
+// for the abandoned request that hasn't hit the socket yet is thrown away.
+//
+// Paged searches (RFC 2696) don't hold a cursor open between pages. The cookie handed back
+// with each page names an entry in a per-session table that remembers the last _id sent, and
+// the next page starts a fresh query after it.
+//
+// An idle session doesn't hold a read buffer - it waits for the socket to become readable
+// and only then asks the framer for space to read into.
+class Session : public std::enable_shared_from_this<Session> {
+public:
+    // The socket may be TCP or a Unix domain socket. peer is how it's named in the logs.
+    // Socket work runs on ioService's threads and requests on operationService's.
+    Session(asio::io_service& ioService, asio::io_service& operationService,
+            asio::generic::stream_protocol::socket sock,
+            std::string peer, PeerCredentials peerCredentials,
+            const SessionOptions& options, Storage::Mongo::MongoBackend& db);
+
+    void start();
+
+private:
+    struct SearchState {
+        std::unique_ptr<Storage::Mongo::MongoCursor> cursor;
+        Storage::Mongo::MongoCursor::iterator it;
+        Storage::Mongo::MongoCursor::iterator end;
+        // Zero unless this is a paged search.
+        size_t pageSize;
+        size_t sent;
+        std::string lastId;
+        Storage::Mongo::ResultOptions result;
+        // Encoded results that haven't been queued yet.
+        Ber::ByteVector batch;
+
+        SearchState(std::unique_ptr<Storage::Mongo::MongoCursor> _cursor, size_t _pageSize,
+                Storage::Mongo::ResultOptions _result):
+            cursor{std::move(_cursor)},
+            it{cursor->begin()},
+            end{cursor->end()},
+            pageSize{_pageSize},
+            sent{0},
+            lastId{},
+            result{std::move(_result)},
+            batch{}
+        {}
+    };
+
+    struct PagedSearch {
+        std::string afterId;
+        // The SearchRequest the cookie was handed out for. The next page must ask for
+        // exactly the same thing.
+        Ber::ByteVector request;
+        std::chrono::steady_clock::time_point expires;
+    };
+
+    struct Operation {
+        uint64_t messageId;
+        Ldap::MessageTag type;
+        // The LDAPMessage is copied out of the framer so it can outlive the read buffer.
+        Ber::ByteVector message;
+        Ber::PacketView protocolOp;
+        Ber::PacketView controls;
+        bool hasControls;
+        std::unique_ptr<SearchState> search;
+        // Set if the connection should be closed once this operation is finished.
+        bool fatal;
+        // Set by an AbandonRequest. Searches check it between entries.
+        std::atomic<bool> abandoned;
+        // What the request parses into comes out of here, and is all freed with the
+        // operation. Only the thread running the operation touches it.
+        Memory::Arena arena;
+    };
+    using OperationPtr = std::shared_ptr<Operation>;
+
+    struct Output {
+        uint64_t messageId;
+        Ber::ByteVector bytes;
+    };
+
+    // These all run on the strand.
+    void waitReadable();
+    void onReadable(const asio::error_code& error);
+    void processMessages();
+    // Returns false if the session should be closed after in-flight requests finish.
+    bool queueMessage(const Ber::PacketView& message);
+    void dispatchPending();
+    void abandon(uint64_t messageId);
+    void onOperationDone(OperationPtr op);
+    void flushOutput();
+    void startWrite();
+    void onWrite(const asio::error_code& error);
+    void maybeClose();
+
+    // These run on any operation thread.
+    void runOperation(OperationPtr op);
+    // Returns true if the bind finished, or false if it's waiting on the hash pool.
+    bool handleBind(OperationPtr op);
+    // Returns the index of the hash that matched, or -1 if none did.
+    int checkPasswords(const std::string& password, const std::vector<std::string>& hashes);
+    // Called once a simple bind's password has matched hashes[matched] of the entry's
+    // userPassword. Upgrades the hash if it needs it and remembers the bind.
+    void passwordVerified(std::shared_ptr<Ldap::Entry> entry, int matched,
+        const std::string& password);
+    void handleSaslBind(uint64_t messageId, const Ldap::Bind::Request& bindReq);
+    void handleExternalBind(uint64_t messageId, const Ldap::Bind::Request& bindReq);
+    void completeBind(uint64_t messageId, const std::string& dn, bool passOkay,
+        std::vector<uint8_t> serverSaslCreds = {});
+    // Returns true if the search finished, or false if it's waiting on the output queue.
+    bool handleSearch(OperationPtr op, const std::vector<Ldap::Control>& controls);
+    void handleMonitorSearch(uint64_t messageId);
+    void handleAdd(uint64_t messageId, const Ber::PacketView& protocolOp,
+        Memory::Arena& arena);
+    void handleModify(uint64_t messageId, const Ber::PacketView& protocolOp,
+        Memory::Arena& arena);
+    void handleDelete(uint64_t messageId, const Ber::PacketView& protocolOp);
+    // Streams search results until the search is done or the output queue is full.
+    bool pumpSearch(OperationPtr op);
+    void resumeSearch(OperationPtr op);
+    void finishOperation(OperationPtr op);
+    // Remembers where a paged search stopped and returns the cookie for the next page.
+    std::string savePagedSearch(const Operation& op, std::string lastId);
+    // Looks up and forgets a cookie, returning the _id to carry on after.
+    std::string takePagedSearch(const std::string& cookie, const Operation& op);
+
+    void sendResponse(uint64_t messageId, Ber::Packet response,
+        const std::vector<Ldap::Control>& controls = {});
+    // For results with no matchedDN, message or controls, which are most of them.
+    void sendResult(uint64_t messageId, Ldap::ErrorCode code, Ldap::MessageTag tag);
+    void queueOutput(uint64_t messageId, Ber::ByteVector bytes);
+    void queueSearchBatch(const Operation& op);
+
+    asio::io_service& _operationService;
+    asio::generic::stream_protocol::socket _sock;
+    asio::io_service::strand _strand;
+    SessionOptions _options;
+    std::string _peer;
+    const PeerCredentials _peerCredentials;
+    Ldap::MessageFramer _framer;
+    Storage::Mongo::MongoBackend& _db;
+
+    // Dispatch state, only touched on the strand.
+    std::deque<OperationPtr> _pending;
+    std::map<uint64_t, OperationPtr> _running;
+    size_t _inFlight;
+    bool _bindInFlight;
+    bool _reading;
+    bool _peerClosed;
+    bool _closing;
+
+    // Output state, shared with the operations and guarded by _outputLock.
+    std::mutex _outputLock;
+    std::deque<Output> _writeQueue;
+    size_t _writeQueueBytes;
+    // How many outputs at the front of _writeQueue the write in progress is sending.
+    size_t _writing;
+    bool _flushPosted;
+    bool _writeFailed;
+    // Searches that stopped because the output queue was full.
+    std::deque<OperationPtr> _parkedSearches;
+    // Requests whose responses should be dropped rather than sent.
+    std::set<uint64_t> _abandoned;
+
+    // Paged search cookies, keyed by the number in the cookie.
+    std::mutex _pagingLock;
+    std::map<uint64_t, PagedSearch> _pagedSearches;
+    uint64_t _nextPagedSearch;
+
+    bool _userBound;
+    std::string _userBoundDN;
+    // The SCRAM exchange waiting for its client-final-message, if there is one. Binds run one
+    // at a time, so only the bind running now touches it.
+    std::unique_ptr<Password::ScramExchange> _scram;
+};
+
+} // namespace Server
@@ -1,12 +1,35 @@
+#pragma once
+
 #include <iterator>
+#include <map>
 #include <memory>
+#include <set>
 #include <string>
+#include <vector>
 
 #include <mongocxx/client.hpp>
+#include <mongocxx/pool.hpp>
+
+#include "entrycache.h"
+#include "ldapproto.h"
 
 namespace Storage {
 
 namespace Mongo {
+
+// Which attributes a search returns, and whether it returns their values.
+struct ResultOptions {
+    explicit ResultOptions(const Ldap::Search::Request& req);
+
+    bool wants(const std::string& attribute) const;
+
+    bool typesOnly;
+    // Set if the request listed no attributes or asked for all of them with "*".
+    bool allAttributes;
+    // Lower-cased. "1.1" asks for none, so it's left out.
+    std::set<std::string> attributes;
+};
+
 class MongoCursor {
 public:
     class iterator;
@@ -19,10 +42,14 @@ public:
     iterator end();
 private:
     friend class MongoBackend;
-    MongoCursor(mongocxx::cursor curs) :
+    MongoCursor(mongocxx::pool::entry client, mongocxx::cursor curs) :
+        _client { std::move(client) },
         _cursor { std::move(curs) }
     { };
 
+    // The cursor uses the client it was created from, so hold on to the client until the
+    // cursor is destroyed. Members are destroyed in reverse order, so this must come first.
+    mongocxx::pool::entry _client;
     mongocxx::cursor _cursor;
 };
 
@@ -34,6 +61,11 @@ public:
     const Ldap::Entry* operator->() { refreshDocument(); return &curEntry; };
     iterator& operator++();
     void operator++(int) { operator++(); };
+    // The _id of the current document, used to pick up where a paged search left off.
+    std::string id();
+    // Appends the current document to out as a complete SearchResultEntry message, written
+    // straight from the BSON without going through an Ldap::Entry or a Ber::Packet.
+    void encodeResult(uint64_t messageId, const ResultOptions& options, Ber::ByteVector& out);
 
     bool operator==(const iterator& rhs) {
         return _cursorIt == rhs._cursorIt;
@@ -46,6 +78,7 @@ private:
     friend class MongoCursor;
 
     void refreshDocument();
+    bsoncxx::document::view currentDocument();
  
     explicit iterator(mongocxx::cursor::iterator curs) :
         _cursorIt { std::move(curs) }
@@ -55,29 +88,119 @@ private:
     Ldap::Entry curEntry;
 };
 
+// findEntries' cursors fetch this many documents at a time from mongo.
+const size_t cursorBatchSize = 1000;
+
+// Asks findEntries for one page of results, in _id order, starting after afterId.
+struct SearchPage {
+    std::string afterId;
+    size_t size;
+};
+
+// The query clause for the entries in scope of a search from baseDn. A subtree search from the
+// empty DN is the whole directory, so its clause is empty.
+bsoncxx::document::value scopeQuery(const std::string& baseDn,
+    Ldap::Search::Request::Scope scope);
+
+// Attribute syntaxes that are stored as typed BSON values rather than strings, so mongo
+// compares them the way their LDAP ordering rules do.
+enum class Syntax {
+    // An int64.
+    Integer,
+    // A date, to the millisecond. Read back as YYYYMMDDHHMMSS[.fff]Z.
+    GeneralizedTime,
+    // A bool. Read back as TRUE or FALSE.
+    Boolean,
+    // A string, with each RDN's attribute type lower-cased and the spaces around it trimmed.
+    DN,
+};
+
+// Maps lower-cased attribute names to their syntax. Anything not in it is a string.
+using Schema = std::map<std::string, Syntax>;
+
+// Takes integer, generalizedTime, boolean or dn, in any case. Throws std::invalid_argument
+// for anything else.
+Syntax parseSyntax(const std::string& name);
+
+struct PoolOptions {
+    int minPoolSize = 0;
+    int maxPoolSize = 100;
+    // How long to wait for a free client when the pool is at maxPoolSize, after which the
+    // operation fails with busy. Parked searches hold on to their clients until the client
+    // reads more, so waiting forever (zero) lets clients that stop reading hang the server.
+    int waitQueueTimeoutMS = 1000;
+};
+
+// MongoBackend is shared by every session in the process. Each operation checks a client out
+// of a mongocxx::pool for as long as it needs it, so the number of connections to mongo is
+// bounded by the pool size rather than the number of LDAP connections.
+//
+// findEntry goes through an EntryCache, since binds and modifies look up the same few
+// entries over and over. Every write through the backend invalidates what it touched, so
+// the cache only goes stale if something else writes to the collection.
+//
+// Values of the normalizedAttributes are also stored in shadow fields, _norm.<attr> holding
+// them case and space folded and _rev.<attr> holding those reversed. Equality, ordering and
+// substring filters on those attributes match case-insensitively against the shadow fields,
+// and each is an index range scan as long as it has an initial or a final substring.
+//
+// Values of attributes in the schema are stored typed, and every attribute in it is
+// indexed, so equality and ordering filters on them are typed index range scans. Saving a
+// value that isn't valid for its syntax fails with invalidAttributeSyntax.
 class MongoBackend {
 public:
     MongoBackend(
         std::string connectURI,
         std::string db,
         std::string collection,
-        std::string rootDN
+        std::string rootDN,
+        PoolOptions poolOptions = PoolOptions{},
+        size_t entryCacheBytes = 64 * 1024 * 1024,
+        std::set<std::string> normalizedAttributes = {},
+        Schema schema = {}
     );
     ~MongoBackend() {};
 
-    MongoBackend(const MongoBackend&) = default;
-    MongoBackend(MongoBackend&&) = default;
+    MongoBackend(const MongoBackend&) = delete;
+    MongoBackend& operator=(const MongoBackend&) = delete;
+
+    // Creates the indexes searches rely on, fills in the tree and shadow fields on any
+    // entries written before they existed and retypes values written under a different
+    // schema. Call once at startup.
+    void prepareCollection();
 
     void saveEntry(Ldap::Entry e, bool insert);
+    // Applies a ModifyRequest's changes in one atomic update that only carries the changed
+    // values, so concurrent modifies can't lose each other's changes. Values keep their order,
+    // with added ones at the end. Throws noSuchObject if there's no such entry,
+    // noSuchAttribute if a delete names an attribute or value the entry doesn't have, and
+    // attributeOrValueExists if an add names a value it already has or a replace repeats one.
+    void modifyEntry(const std::string& dn,
+        const Memory::ArenaVector<Ldap::Modify::Modification>& mods);
     std::unique_ptr<Ldap::Entry> findEntry(std::string dn);
-    std::unique_ptr<MongoCursor> findEntries(Ldap::Search::Request req);
+    // If page is set, the cursor returns up to page->size + 1 entries, so the caller can tell
+    // whether there's another page without running another query.
+    std::unique_ptr<MongoCursor> findEntries(const Ldap::Search::Request& req,
+        const SearchPage* page = nullptr);
     void deleteEntry(std::string dn);
 
 private:
-
-    mongocxx::client _client;
-    mongocxx::collection _collection;
+    mongocxx::pool::entry acquireClient();
+    mongocxx::collection collection(mongocxx::pool::entry& client);
+    void prepareShadowFields(mongocxx::collection& coll);
+    void prepareTypedFields(mongocxx::collection& coll);
+    // Throws noSuchObject if the entry is missing and code if it isn't.
+    [[noreturn]] void throwModifyError(mongocxx::collection& coll, const std::string& dnId,
+        Ldap::ErrorCode code);
+
+    mongocxx::pool _pool;
+    std::string _db;
+    std::string _collection;
     std::string _rootdn;
+    EntryCache _cache;
+    // Lower-cased attribute names.
+    const std::set<std::string> _normalized;
+    const Schema _schema;
 
 };
 
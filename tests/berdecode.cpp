@@ -0,0 +1,79 @@
+// Checks Ber::Decode's INTEGER sign extension and range checks, and that SequenceOf/SetOf
+// reserve their container before filling it.
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "berdecode.h"
+
+namespace {
+
+namespace D = Ber::Decode;
+
+// Encodes a primitive element with exactly these content octets, so the test controls the
+// encoded length.
+Ber::ByteVector encode(Ber::Packet packet) {
+    Ber::ByteVector out;
+    packet.copyBytes(out);
+    return out;
+}
+
+template<typename Shape, typename Out>
+bool decodes(const Ber::ByteVector& bytes, Out& out) {
+    auto end = bytes.cend();
+    auto view = Ber::PacketView::decode(bytes.cbegin(), end);
+    try {
+        D::decode<Shape>(view, out);
+    } catch (const Ldap::Exception& e) {
+        if (e != Ldap::ErrorCode::protocolError)
+            throw;
+        return false;
+    }
+    return true;
+}
+
+template<typename Out>
+bool checkInteger(const char* what, Ber::ByteVector content, bool valid, Out expected = 0) {
+    Out out = 0;
+    bool ok = decodes<D::Integer>(encode(Ber::Packet(Ber::Tag::Integer, std::move(content))),
+        out);
+    ok = valid ? (ok && out == expected) : !ok;
+    printf("%s %s\n", ok ? "ok  " : "FAIL", what);
+    return ok;
+}
+
+} // namespace
+
+int main() {
+    bool ok = true;
+
+    ok &= checkInteger<int>("0", {0x00}, true, 0);
+    ok &= checkInteger<int>("127", {0x7f}, true, 127);
+    ok &= checkInteger<int>("128", {0x00, 0x80}, true, 128);
+    ok &= checkInteger<int>("-1", {0xff}, true, -1);
+    ok &= checkInteger<int>("-128", {0x80}, true, -128);
+    ok &= checkInteger<int>("-129", {0xff, 0x7f}, true, -129);
+    ok &= checkInteger<int>("int max", {0x7f, 0xff, 0xff, 0xff}, true, 2147483647);
+    ok &= checkInteger<int>("int min", {0x80, 0x00, 0x00, 0x00}, true, -2147483647 - 1);
+    ok &= checkInteger<int>("int max + 1", {0x00, 0x80, 0x00, 0x00, 0x00}, false);
+    ok &= checkInteger<int>("int min - 1", {0xff, 0x7f, 0xff, 0xff, 0xff}, false);
+    ok &= checkInteger<int64_t>("int64 min", {0x80, 0, 0, 0, 0, 0, 0, 0}, true,
+        INT64_MIN);
+    ok &= checkInteger<int64_t>("int64 max", {0x7f, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff},
+        true, INT64_MAX);
+    ok &= checkInteger<uint64_t>("negative into unsigned", {0xff}, false);
+    ok &= checkInteger<int64_t>("nine octets", {0x00, 0x80, 0, 0, 0, 0, 0, 0, 0}, false);
+    ok &= checkInteger<int>("no octets", {}, false);
+
+    Ber::Packet set(Ber::Type::Constructed, Ber::Class::Universal, Ber::Tag::Set);
+    for (int i = 0; i < 5; i++)
+        set.emplaceChild(Ber::Tag::OctetString, "value " + std::to_string(i));
+    std::vector<std::string> values;
+    bool reserved = decodes<D::SetOf<D::OctetString<>>>(encode(std::move(set)), values) &&
+        values.size() == 5 && values.capacity() == 5;
+    printf("%s SetOf reserves its container\n", reserved ? "ok  " : "FAIL");
+    ok &= reserved;
+
+    return ok ? 0 : 1;
+}
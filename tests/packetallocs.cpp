@@ -0,0 +1,79 @@
+// Checks that building a Ber::Packet tree allocates at most once per node, as ber.h promises,
+// by counting calls to operator new around the code that builds it.
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+
+#include "ber.h"
+#include "ldapproto.h"
+
+namespace {
+
+size_t allocations = 0;
+
+size_t countNodes(const Ber::Packet& p) {
+    size_t count = 1;
+    for (const auto& child: p.children) {
+        count += countNodes(child);
+    }
+    return count;
+}
+
+bool check(bool ok, const char* what, size_t allocs, size_t nodes) {
+    printf("%s %s: %zu allocations for %zu nodes\n", ok ? "ok  " : "FAIL", what, allocs, nodes);
+    return ok;
+}
+
+} // namespace
+
+void* operator new(size_t size) {
+    allocations++;
+    void* p = malloc(size ? size : 1);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+
+int main() {
+    bool ok = true;
+
+    Ldap::Entry entry("uid=someone,ou=people,dc=example,dc=com");
+    entry.appendValue("objectClass", "top");
+    entry.appendValue("objectClass", "person");
+    entry.appendValue("objectClass", "posixAccount");
+    entry.appendValue("cn", "Some One");
+    entry.appendValue("sn", "One");
+    entry.appendValue("uid", "someone");
+    entry.appendValue("uidNumber", "1000");
+    entry.appendValue("homeDirectory", "/home/someone");
+    for (int i = 0; i < 10; i++) {
+        entry.appendValue("memberOf",
+            "cn=group" + std::to_string(i) + ",ou=groups,dc=example,dc=com");
+    }
+
+    size_t before = allocations;
+    Ber::Packet result = Ldap::Search::generateResult(entry);
+    size_t allocs = allocations - before;
+    size_t nodes = countNodes(result);
+    ok &= check(allocs <= nodes, "SearchResEntry", allocs, nodes);
+
+    // Moving a finished subtree into a reserved parent must not copy any of it.
+    Ber::Packet envelope(Ber::Type::Constructed, Ber::Class::Universal, Ber::Tag::Sequence);
+    envelope.reserveChildren(2);
+    envelope.emplaceChild(Ber::Tag::Integer, static_cast<uint64_t>(1));
+    before = allocations;
+    envelope.appendChild(std::move(result));
+    allocs = allocations - before;
+    ok &= check(allocs == 0, "appendChild(Packet&&)", allocs, nodes);
+
+    return ok ? 0 : 1;
+}
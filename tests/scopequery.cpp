@@ -0,0 +1,34 @@
+// Checks the _id/_parent clauses that searches and deletes use to pick the entries in scope.
+#include <cstdio>
+#include <string>
+
+#include <bsoncxx/json.hpp>
+
+#include "storage.h"
+
+namespace {
+
+using Scope = Ldap::Search::Request::Scope;
+
+bool check(const char* what, const std::string& baseDn, Scope scope, const char* expected) {
+    auto query = Storage::Mongo::scopeQuery(baseDn, scope);
+    auto want = bsoncxx::from_json(expected);
+    bool ok = query.view() == want.view();
+    printf("%s %s: %s\n", ok ? "ok  " : "FAIL", what, bsoncxx::to_json(query.view()).c_str());
+    return ok;
+}
+
+} // namespace
+
+int main() {
+    bool ok = true;
+    ok &= check("subtree from the root DSE", "", Scope::Sub, "{}");
+    ok &= check("one level from the root DSE", "", Scope::One, R"({"_parent": ""})");
+    ok &= check("subtree", "dc=example, DC=com", Scope::Sub,
+        R"({"$or": [{"_id": "dc=com,dc=example"},
+            {"_id": {"$gte": "dc=com,dc=example,", "$lt": "dc=com,dc=example-"}}]})");
+    ok &= check("one level", "dc=example,dc=com", Scope::One,
+        R"({"_parent": "dc=com,dc=example"})");
+    ok &= check("base", "dc=example,dc=com", Scope::Base, R"({"_id": "dc=com,dc=example"})");
+    return ok ? 0 : 1;
+}